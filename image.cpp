@@ -0,0 +1,4118 @@
+/*
+ * panofill - fills transparent areas in panorama images.
+ * Copyright (C) 2010, 2011, 2018  Benedikt Freisen
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <mutex>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tiffio.h"
+#include "pyramid.h"
+#define PI 3.14159265
+#define TILE_WIDTH 64
+#define TILE_HEIGHT 8
+#define BLEND_CHUNK 256
+#define OUTPUT_TILE 256
+#define OUTPUT_STRIP_BYTES 262144
+#define CLASSIC_TIFF_BYTES 0xf0000000ULL
+#define STREAM_ROWS 64
+#define PLAN_MAGIC "panofill plan 1\n"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <libintl.h>
+#include <boost/format.hpp>
+
+using namespace std;
+using boost::format;
+
+/*
+ * What the fill of one level records for a plan: the tiles it blends, and
+ * below the finest level the alpha value of every pixel after the alpha
+ * correction and the sum of the weighted alpha values it was computed from.
+ * levels holds the records of all levels of the fill, in order.
+ */
+struct t_levelRecord
+{
+    int width;
+    int height;
+    vector<char> blended;
+    vector<float> alpha;
+    vector<float> sums;
+    deque<t_levelRecord>* levels;
+};
+
+/*
+ * The helper threads of a context.  They wait for the next task of
+ * runWorkers() and call it with their index, from 1 on.  round counts the
+ * tasks, helpers of the threads take part in the current one and running of
+ * them have not finished it yet.
+ */
+struct t_workers
+{
+    mutex lock;
+    condition_variable started;
+    condition_variable finished;
+    vector<thread> threads;
+    const function<void(int)>* task;
+    unsigned long long round;
+    int helpers;
+    int running;
+    bool busy;
+    bool stopping;
+};
+
+/*
+ * The state of a context that is private to the library.
+ */
+struct t_contextState
+{
+    t_workers workers;
+};
+
+/*
+ * The memory of an arena and the scratch rows of its threads.  memory is
+ * over-allocated by 63 bytes to align its start; fileBacked tells whether
+ * it is a mapped scratch file.
+ */
+struct t_arenaState
+{
+    char* memory;
+    size_t capacity;
+    size_t used;
+    bool fileBacked;
+    vector<t_scratch> scratchRows;
+};
+
+static void workerLoop(t_workers* workers, int index, unsigned long long seen)
+{
+    unique_lock<mutex> guard(workers->lock);
+    for (;;)
+    {
+        workers->started.wait(guard, [&] { return workers->stopping || workers->round != seen; });
+        if (workers->stopping)
+            return;
+        seen = workers->round;
+        if (index > workers->helpers)
+            continue;
+        guard.unlock();
+        (*workers->task)(index);
+        guard.lock();
+        if (--workers->running == 0)
+            workers->finished.notify_all();
+    }
+}
+
+/*
+ * Calls task(0) on the calling thread and task(1) to task(n - 1) on the
+ * helper threads of context, which are started as they are first needed.
+ * Returns when all calls have returned.  If the helpers are busy with
+ * another task, for example of another image that is loaded or saved with
+ * the same context at the same time, task runs on threads of its own.
+ */
+static void runWorkers(const t_context* context, int n, const function<void(int)>& task)
+{
+    if (n == 1)
+    {
+        task(0);
+        return;
+    }
+    t_workers* workers = &context->state->workers;
+    unique_lock<mutex> guard(workers->lock);
+    if (workers->busy)
+    {
+        guard.unlock();
+        vector<thread> helpers;
+        for (int i = 1; i < n; i++)
+            helpers.push_back(thread(task, i));
+        task(0);
+        for (size_t i = 0; i < helpers.size(); i++)
+            helpers[i].join();
+        return;
+    }
+    workers->busy = true;
+    while ((int)workers->threads.size() < n - 1)
+        workers->threads.push_back(thread(workerLoop, workers, (int)workers->threads.size() + 1, workers->round));
+    workers->task = &task;
+    workers->helpers = workers->running = n - 1;
+    workers->round++;
+    workers->started.notify_all();
+    guard.unlock();
+    task(0);
+    guard.lock();
+    workers->finished.wait(guard, [&] { return workers->running == 0; });
+    workers->busy = false;
+}
+
+/*
+ * Calls kernel(y0, y1, worker) for consecutive bands of the rows 0 to
+ * rows - 1 on up to context->threads threads, where worker is the index of
+ * the calling thread, from 0 to context->threads - 1, for its scratch rows.
+ * Every row belongs to exactly one band and kernels only write to the rows
+ * of their own band, so the result does not depend on the number of
+ * threads.  The threads are those of runWorkers(), which keeps them
+ * between calls.
+ *
+ * If done is given, the rows are processed in waves of STREAM_ROWS rows, and
+ * done(y0, y1) is called after the rows [y0, y1) and all rows before them
+ * are finished, before any row of the next wave starts.  Kernels on file
+ * backed images use it to evict the rows that the following waves no longer
+ * read.  The threads stay alive from wave to wave.
+ */
+void forEachRowBand(const t_context* context, int rows, const function<void(int, int, int)>& kernel, bool progress,
+                    const function<void(int, int)>& done)
+{
+    if (rows <= 0)
+        return;
+    int wave = done ? min(rows, STREAM_ROWS) : rows;
+    int n = max(1, min(context->threads, wave));
+    int band = max(1, wave / (n * 16));
+    int wavesTotal = (rows + wave - 1) / wave;
+    int bandsPerWave = (wave + band - 1) / band;
+    // the threads claim the bands of all waves in order and wait before
+    // the first band of a wave until the previous wave is done
+    atomic<int> next(0);
+    atomic<int> finished(0);
+    mutex lock;
+    condition_variable released;
+    int wavesDone = 0;
+    runWorkers(context, n, [&](int index)
+    {
+        bool master = index == 0;
+        int i;
+        while ((i = next++) < wavesTotal * bandsPerWave)
+        {
+            int k = i / bandsPerWave;
+            int w1 = min(rows, (k + 1) * wave);
+            int y0 = k * wave + i % bandsPerWave * band;
+            int y1 = min(w1, y0 + band);
+            if (k > 0)
+            {
+                unique_lock<mutex> guard(lock);
+                released.wait(guard, [&] { return wavesDone >= k; });
+            }
+            if (y0 >= y1)
+                continue;
+            if (master && progress && context->verbosity > 1)
+                clog << "   " << fixed << setprecision(2) << (float)finished / rows * 100 << "%          \r";
+            kernel(y0, y1, index);
+            // the thread that finishes the last band of a wave ends it
+            if ((finished += y1 - y0) == w1)
+            {
+                if (done)
+                    done(k * wave, w1);
+                lock_guard<mutex> guard(lock);
+                wavesDone = k + 1;
+                released.notify_all();
+            }
+        }
+    });
+}
+
+arena::arena()
+{
+    state = new t_arenaState();
+    state->memory = NULL;
+    state->capacity = 0;
+    state->used = 0;
+    state->fileBacked = false;
+}
+
+static void unreserve(t_arenaState* state)
+{
+    if (state->fileBacked)
+        munmap(state->memory, state->capacity + 63);
+    else
+        delete[] state->memory;
+    state->memory = NULL;
+    state->capacity = 0;
+    state->fileBacked = false;
+}
+
+arena::~arena()
+{
+    unreserve(state);
+    delete state;
+}
+
+/*
+ * Returns size bytes of shared memory backed by an unlinked scratch file in
+ * $TMPDIR or /tmp, or NULL if there is no room for one.
+ */
+static char* mapScratchFile(size_t size)
+{
+    const char* dir = getenv("TMPDIR");
+    string name = string(dir != NULL && *dir ? dir : "/tmp") + "/panofill-XXXXXX";
+    vector<char> path(name.begin(), name.end());
+    path.push_back(0);
+    int fd = mkstemp(path.data());
+    if (fd < 0)
+        return NULL;
+    unlink(path.data());
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return p == MAP_FAILED ? NULL : (char*)p;
+}
+
+/*
+ * Makes sure that the arena can hold all levels of a pyramid whose finest
+ * level has width × height pixels of four channels of channelBytes bytes,
+ * which is about 4/3 of the finest level.  Pyramids larger than maxMemory
+ * bytes are backed by a scratch file, so that the operating system can page
+ * them out instead of running out of memory.  Returns false, and leaves the
+ * arena empty, if the scratch file cannot be created.
+ */
+bool arena::reserve(int width, int height, int threads, int channelBytes, size_t maxMemory)
+{
+    size_t size = 0;
+    for (int w = width, h = height; ; w = (w + 1) / 2, h = (h + 1) / 2)
+    {
+        size += ((size_t)w * h * 4 * channelBytes + 63) & ~(size_t)63;
+        if (w == 1 && h == 1)
+            break;
+    }
+    bool mapping = maxMemory > 0 && size > maxMemory;
+    if ((size > state->capacity || mapping != state->fileBacked) && state->used == 0)
+    {
+        unreserve(state);
+        if (mapping)
+        {
+            state->memory = mapScratchFile(size + 63);
+            if (state->memory == NULL)
+                return false;
+        }
+        else
+            state->memory = new char[size + 63];
+        state->fileBacked = mapping;
+        state->capacity = size;
+    }
+    if (state->scratchRows.size() < (size_t)threads)
+        state->scratchRows.resize(threads);
+    return true;
+}
+
+/*
+ * Returns size bytes aligned to 64 bytes.  Requests beyond the reserved
+ * memory are passed on to the heap.
+ */
+void* arena::allocate(size_t size)
+{
+    size = (size + 63) & ~(size_t)63;
+    char* base = (char*)(((size_t)state->memory + 63) & ~(size_t)63);
+    if (state->memory == NULL || state->used + size > state->capacity)
+        return ::operator new(size);
+    state->used += size;
+    return base + state->used - size;
+}
+
+/*
+ * Returns the memory at p and everything allocated after it to the arena.
+ */
+void arena::release(void* p)
+{
+    char* base = (char*)(((size_t)state->memory + 63) & ~(size_t)63);
+    if (state->memory == NULL || (char*)p < base || (char*)p >= base + state->capacity)
+        ::operator delete(p);
+    else
+        state->used = (char*)p - base;
+}
+
+size_t arena::reserved()
+{
+    return state->capacity;
+}
+
+bool arena::mapped()
+{
+    return state->fileBacked;
+}
+
+/*
+ * Drops the pages within size bytes at p from memory if the arena is file
+ * backed.  Their contents stay in the scratch file and are read again on the
+ * next access.
+ */
+void arena::evict(const void* p, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = ((size_t)p + page - 1) & ~(page - 1);
+    size_t end = ((size_t)p + size) & ~(page - 1);
+    if (state->fileBacked && end > begin && (char*)begin >= state->memory &&
+        (char*)end <= state->memory + state->capacity + 63)
+        madvise((void*)begin, end - begin, MADV_DONTNEED);
+}
+
+/*
+ * Returns the scratch rows of the given worker of forEachRowBand().
+ * reserve() must have been called since the number of threads last changed.
+ */
+t_scratch& arena::scratch(int worker)
+{
+    return state->scratchRows[worker];
+}
+
+
+/*
+ * Conversions between floats from 0 to 1 and the 16 bit normalized integers
+ * of compact images.  Dividing instead of multiplying with the reciprocal
+ * keeps 65535 at exactly 1, which the opacity tests rely on.
+ */
+static inline unsigned short pack16(float v)
+{
+    return (unsigned short)(min(1.0f, max(0.0f, v)) * 65535 + 0.5f);
+}
+
+static inline float unpack16(unsigned short v)
+{
+    return v / 65535.0f;
+}
+
+/*
+ * Conversions of the samples of TIFF files and images in memory to the
+ * channels of the image and back, one for every sample type.  Integer
+ * samples are scaled to 0 … 1, float samples are taken as they are, so that
+ * colours above 1 survive in float storage.
+ */
+static inline float sampleToFloat(unsigned char v)
+{
+    return (float)v / 255;
+}
+
+static inline float sampleToFloat(unsigned short v)
+{
+    return (float)v / 65535;
+}
+
+static inline float sampleToFloat(float v)
+{
+    return v;
+}
+
+// v / 255 is exactly v * 257 / 65535
+static inline unsigned short sampleTo16(unsigned char v)
+{
+    return v * 257;
+}
+
+static inline unsigned short sampleTo16(unsigned short v)
+{
+    return v;
+}
+
+static inline unsigned short sampleTo16(float v)
+{
+    return pack16(v);
+}
+
+static inline void floatToSample(float v, unsigned char& out)
+{
+    out = v <= 0 ? 0 : v >= 1 ? 255 : (unsigned char)(v * 255);
+}
+
+// rounds, so that 16 bit storage is written back unchanged
+static inline void floatToSample(float v, unsigned short& out)
+{
+    out = v <= 0 ? 0 : v >= 1 ? 65535 : (unsigned short)(v * 65535 + 0.5f);
+}
+
+static inline void floatToSample(float v, float& out)
+{
+    out = v;
+}
+
+/*
+ * Returns the pixel of RGB or RGBA samples of the type T at in.  Pixels
+ * without alpha are opaque, unassociated alpha is multiplied in like
+ * TIFFReadRGBAStrip() does.
+ */
+template <typename T, int samples>
+static inline t_fpixel decodePixel(const T* in, bool unassociated)
+{
+    t_fpixel p = {sampleToFloat(in[0]), sampleToFloat(in[1]), sampleToFloat(in[2]),
+                  samples == 4 ? sampleToFloat(in[3]) : 1.0f};
+    p.a = p.a < 0 ? 0 : p.a > 1 ? 1 : p.a;
+    if (unassociated)
+    {
+        p.r *= p.a;
+        p.g *= p.a;
+        p.b *= p.a;
+    }
+    return p;
+}
+
+/*
+ * Converts columns pixels of samples of the type T at in to row y of img,
+ * starting at column x0.
+ */
+template <typename T, int samples>
+static void decodeRow(image* img, int y, int x0, int columns, const void* pixels, bool unassociated)
+{
+    const T* in = (const T*)pixels;
+    if (img->compact && !unassociated)
+    {
+        unsigned short* r = img->plane16(0, y) + x0;
+        unsigned short* g = img->plane16(1, y) + x0;
+        unsigned short* b = img->plane16(2, y) + x0;
+        unsigned short* a = img->plane16(3, y) + x0;
+        for (int x = 0; x < columns; x++)
+        {
+            r[x] = sampleTo16(in[x * samples]);
+            g[x] = sampleTo16(in[x * samples + 1]);
+            b[x] = sampleTo16(in[x * samples + 2]);
+            a[x] = samples == 4 ? sampleTo16(in[x * samples + 3]) : 65535;
+        }
+    }
+    else if (img->compact)
+    {
+        for (int x = 0; x < columns; x++)
+        {
+            t_fpixel p = decodePixel<T, samples>(in + x * samples, unassociated);
+            img->plane16(0, y)[x0 + x] = pack16(p.r);
+            img->plane16(1, y)[x0 + x] = pack16(p.g);
+            img->plane16(2, y)[x0 + x] = pack16(p.b);
+            img->plane16(3, y)[x0 + x] = pack16(p.a);
+        }
+    }
+    else if (img->planes != NULL)
+    {
+        float* r = img->plane(0, y) + x0;
+        float* g = img->plane(1, y) + x0;
+        float* b = img->plane(2, y) + x0;
+        float* a = img->plane(3, y) + x0;
+        for (int x = 0; x < columns; x++)
+        {
+            t_fpixel p = decodePixel<T, samples>(in + x * samples, unassociated);
+            r[x] = p.r;
+            g[x] = p.g;
+            b[x] = p.b;
+            a[x] = p.a;
+        }
+    }
+    else
+    {
+        t_fpixel* out = img->data + (size_t)y * img->width + x0;
+        for (int x = 0; x < columns; x++)
+            out[x] = decodePixel<T, samples>(in + x * samples, unassociated);
+    }
+}
+
+/*
+ * Converts columns pixels of row y of img, starting at column x0, to RGBA
+ * samples of the type T at pixels.
+ */
+template <typename T>
+static void encodeRow(image* img, int y, int x0, int columns, void* pixels)
+{
+    T* out = (T*)pixels;
+    if (img->compact)
+    {
+        const unsigned short* r = img->plane16(0, y) + x0;
+        const unsigned short* g = img->plane16(1, y) + x0;
+        const unsigned short* b = img->plane16(2, y) + x0;
+        const unsigned short* a = img->plane16(3, y) + x0;
+        for (int x = 0; x < columns; x++)
+        {
+            floatToSample(unpack16(r[x]), out[x * 4]);
+            floatToSample(unpack16(g[x]), out[x * 4 + 1]);
+            floatToSample(unpack16(b[x]), out[x * 4 + 2]);
+            floatToSample(unpack16(a[x]), out[x * 4 + 3]);
+        }
+    }
+    else if (img->planes != NULL)
+    {
+        const float* r = img->plane(0, y) + x0;
+        const float* g = img->plane(1, y) + x0;
+        const float* b = img->plane(2, y) + x0;
+        const float* a = img->plane(3, y) + x0;
+        for (int x = 0; x < columns; x++)
+        {
+            floatToSample(r[x], out[x * 4]);
+            floatToSample(g[x], out[x * 4 + 1]);
+            floatToSample(b[x], out[x * 4 + 2]);
+            floatToSample(a[x], out[x * 4 + 3]);
+        }
+    }
+    else
+    {
+        const t_fpixel* in = img->data + (size_t)y * img->width + x0;
+        for (int x = 0; x < columns; x++)
+        {
+            floatToSample(in[x].r, out[x * 4]);
+            floatToSample(in[x].g, out[x * 4 + 1]);
+            floatToSample(in[x].b, out[x * 4 + 2]);
+            floatToSample(in[x].a, out[x * 4 + 3]);
+        }
+    }
+}
+
+typedef void (*t_decodeRow)(image* img, int y, int x0, int columns, const void* pixels, bool unassociated);
+
+t_region::t_region()
+{
+    x = 0;
+    y = 0;
+    width = 0;
+    height = 0;
+    south = -90;
+    north = 90;
+    maskWidth = 0;
+    maskHeight = 0;
+}
+
+bool t_region::limited() const
+{
+    return width > 0 || south > -90 || north < 90 || !mask.empty();
+}
+
+/*
+ * Returns the runs of pixels inside the region of a panorama of the given
+ * size, ordered by rows and columns, with row 0 at the top as in the file.
+ */
+vector<t_span> t_region::spans(int imageWidth, int imageHeight) const
+{
+    // the rows whose centres lie in the band of latitudes
+    int y0 = max(0, (int)ceil((90 - north) / 180 * imageHeight - 0.5));
+    int y1 = min(imageHeight, (int)floor((90 - south) / 180 * imageHeight - 0.5) + 1);
+    vector<t_span> columns;
+    if (width <= 0 || width >= imageWidth)
+    {
+        t_span all = {0, 0, imageWidth};
+        columns.push_back(all);
+    }
+    else
+    {
+        int x0 = (x % imageWidth + imageWidth) % imageWidth;
+        t_span wrapped = {0, 0, x0 + width - imageWidth};
+        t_span s = {0, x0, min(imageWidth, x0 + width)};
+        if (wrapped.x1 > 0)
+            columns.push_back(wrapped);
+        columns.push_back(s);
+    }
+    if (width > 0)
+    {
+        y0 = max(y0, y);
+        y1 = min(y1, y + height);
+    }
+    vector<t_span> spans;
+    for (int r = y0; r < y1; r++)
+    {
+        const char* m = mask.empty() ? NULL : &mask[(size_t)((long long)r * maskHeight / imageHeight) * maskWidth];
+        for (size_t i = 0; i < columns.size(); i++)
+        {
+            int run = -1;
+            for (int c = columns[i].x0; c <= columns[i].x1; c++)
+            {
+                bool inside = c < columns[i].x1 && (m == NULL || m[(long long)c * maskWidth / imageWidth]);
+                if (inside && run < 0)
+                    run = c;
+                if (!inside && run >= 0)
+                {
+                    t_span s = {r, run, c};
+                    spans.push_back(s);
+                    run = -1;
+                }
+            }
+        }
+    }
+    return spans;
+}
+
+t_context::t_context()
+{
+    verbosity = 0;
+    interpolator = 1;
+    threads = 1;
+    scalarKernels = false;
+    storageBits = 32;
+    fixedPoint = false;
+    maxMemory = 0;
+    poleCaps = false;
+    compression = COMPRESSION_NONE;
+    tiledOutput = false;
+    state = new t_contextState();
+    t_workers* workers = &state->workers;
+    workers->task = NULL;
+    workers->round = 0;
+    workers->helpers = workers->running = 0;
+    workers->busy = workers->stopping = false;
+}
+
+t_context::~t_context()
+{
+    t_workers* workers = &state->workers;
+    {
+        lock_guard<mutex> guard(workers->lock);
+        workers->stopping = true;
+        workers->started.notify_all();
+    }
+    for (size_t i = 0; i < workers->threads.size(); i++)
+        workers->threads[i].join();
+    delete state;
+}
+
+image::image(const t_context* context, int width, int height, t_fpixel* data, bool manageData)
+{
+    image::context = context;
+    image::width = width;
+    image::height = height;
+    image::data = data;
+    image::planes = NULL;
+    image::manageData = manageData;
+    tilesX = tilesY = 0;
+    source = NULL;
+    corrected = false;
+    pool = NULL;
+    pooled = false;
+    scratchFailed = false;
+    compact = false;
+    flat = false;
+    fileFormat = FORMAT_RGBA8;
+    recording = NULL;
+}
+
+image::image(const t_context* context, int width, int height, float* planes, bool manageData)
+{
+    image::context = context;
+    image::width = width;
+    image::height = height;
+    image::data = NULL;
+    image::planes = planes;
+    image::manageData = manageData;
+    source = NULL;
+    corrected = false;
+    pool = NULL;
+    pooled = false;
+    scratchFailed = false;
+    compact = false;
+    flat = false;
+    fileFormat = FORMAT_RGBA8;
+    recording = NULL;
+    initTiles(true);
+}
+
+/*
+ * A file in memory for the TIFF handles that compress single strips or tiles
+ * and for the standard input.
+ */
+struct t_memfile
+{
+    vector<char> bytes;
+    toff_t position;
+};
+
+static tsize_t memRead(thandle_t h, tdata_t buf, tsize_t size)
+{
+    t_memfile* f = (t_memfile*)h;
+    size = max((tsize_t)0, min(size, (tsize_t)f->bytes.size() - (tsize_t)f->position));
+    copy(f->bytes.begin() + f->position, f->bytes.begin() + f->position + size, (char*)buf);
+    f->position += size;
+    return size;
+}
+
+static tsize_t memWrite(thandle_t h, tdata_t buf, tsize_t size)
+{
+    t_memfile* f = (t_memfile*)h;
+    if (f->position + size > f->bytes.size())
+        f->bytes.resize(f->position + size);
+    copy((char*)buf, (char*)buf + size, f->bytes.begin() + f->position);
+    f->position += size;
+    return size;
+}
+
+static toff_t memSeek(thandle_t h, toff_t offset, int whence)
+{
+    t_memfile* f = (t_memfile*)h;
+    if (whence == SEEK_CUR)
+        offset += f->position;
+    else if (whence == SEEK_END)
+        offset += f->bytes.size();
+    return f->position = offset;
+}
+
+static int memClose(thandle_t)
+{
+    return 0;
+}
+
+static toff_t memSize(thandle_t h)
+{
+    return ((t_memfile*)h)->bytes.size();
+}
+
+static int memMap(thandle_t h, tdata_t* base, toff_t* size)
+{
+    t_memfile* f = (t_memfile*)h;
+    *base = f->bytes.data();
+    *size = f->bytes.size();
+    return 1;
+}
+
+static void memUnmap(thandle_t, tdata_t, toff_t)
+{
+}
+
+/*
+ * Opens the TIFF file s for reading, or the standard input if s is "-".  The
+ * standard input may be a pipe, which libtiff cannot seek in, so it is read
+ * into input first and decoded from there.
+ */
+static TIFF* openInput(const char* s, t_memfile& input)
+{
+    if (strcmp(s, "-") != 0)
+        return TIFFOpen(s, "r");
+    input.position = 0;
+    size_t size = 0;
+    ssize_t n;
+    do
+    {
+        if (input.bytes.size() < size + 65536)
+            input.bytes.resize(max((size_t)65536, input.bytes.size() * 2));
+        n = read(STDIN_FILENO, &input.bytes[size], input.bytes.size() - size);
+        if (n > 0)
+            size += n;
+    }
+    while (n > 0 || (n < 0 && errno == EINTR));
+    if (n < 0)
+        return NULL;
+    input.bytes.resize(size);
+    return TIFFClientOpen("-", "r", (thandle_t)&input, memRead, memWrite, memSeek, memClose, memSize, memMap,
+                          memUnmap);
+}
+
+/*
+ * Loads a TIFF file, or the standard input if s is "-".  The SIMD kernels
+ * need planar storage, the scalar ones work on interleaved pixels; either is
+ * taken from pool.  fileFormat receives the sample format of the file.
+ */
+image::image(const t_context* context, const char* s, arena* pool)
+{
+    image::context = context;
+    data = NULL;
+    planes = NULL;
+    manageData = false;
+    tilesX = tilesY = 0;
+    source = NULL;
+    corrected = false;
+    image::pool = pool;
+    pooled = false;
+    scratchFailed = false;
+    compact = false;
+    flat = false;
+    fileFormat = FORMAT_RGBA8;
+    recording = NULL;
+    t_memfile input;
+    TIFF* tif = openInput(s, input);
+    if (tif)
+    {
+        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+        bool ok = allocate(!context->scalarKernels);
+        if (planes != NULL)
+            initTiles(true);
+        ok = ok && loadTIFF(tif);
+        TIFFClose(tif);
+        if (!ok)
+        {
+            if (pooled)
+                pool->release(planes != NULL ? (void*)planes : (void*)data);
+            data = NULL;
+            planes = NULL;
+            manageData = pooled = false;
+        }
+        else if (planes != NULL)
+            summarizeTiles(valid);
+    }
+}
+
+/*
+ * Copies an image in memory.  Row y starts stride bytes after row y - 1 at
+ * pixels and the top row comes first, as in a TIFF file.  fileFormat
+ * receives format.
+ */
+image::image(const t_context* context, const void* pixels, int width, int height, ptrdiff_t stride,
+             t_format format, arena* pool)
+{
+    image::context = context;
+    image::width = width;
+    image::height = height;
+    data = NULL;
+    planes = NULL;
+    manageData = false;
+    tilesX = tilesY = 0;
+    source = NULL;
+    corrected = false;
+    image::pool = pool;
+    pooled = false;
+    scratchFailed = false;
+    compact = false;
+    flat = false;
+    fileFormat = format;
+    recording = NULL;
+    if (!allocate(!context->scalarKernels))
+        return;
+    if (planes != NULL)
+        initTiles(true);
+    t_decodeRow decode = format == FORMAT_RGBA8 ? decodeRow<unsigned char, 4>
+                       : format == FORMAT_RGBA16 ? decodeRow<unsigned short, 4> : decodeRow<float, 4>;
+    forEachRowBand(context, height, [&](int y0, int y1, int)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            decode(this, y, 0, width, (const char*)pixels + (height - 1 - y) * stride, false);
+            if (planes != NULL)
+                coverRow(y, 0, width);
+        }
+    }, false, evictor([&](int y0, int y1) { evictRows(y0, y1); }));
+    if (planes != NULL)
+        summarizeTiles(valid);
+}
+
+/*
+ * Allocates the storage of the finest level and reserves pool for the
+ * coarser ones.  Returns false, with scratchFailed set, if the pyramid needs
+ * a scratch file that cannot be created.
+ */
+bool image::allocate(bool planar)
+{
+    compact = planar && context->storageBits == 16;
+    int channelBytes = compact ? sizeof(unsigned short) : sizeof(float);
+    if (!pool->reserve(width, height, context->threads, channelBytes, context->maxMemory))
+    {
+        scratchFailed = true;
+        return false;
+    }
+    void* storage = pool->allocate((size_t)width * height * 4 * channelBytes);
+    if (planar)
+        planes = (float*)storage;
+    else
+        data = (t_fpixel*)storage;
+    pooled = true;
+    return true;
+}
+
+/*
+ * Returns done if the image is kept in a scratch file and NULL otherwise, so
+ * that kernels on images in memory run without waves, see forEachRowBand().
+ */
+function<void(int, int)> image::evictor(const function<void(int, int)>& done)
+{
+    if (pooled && pool->mapped())
+        return done;
+    return NULL;
+}
+
+/*
+ * Drops the rows [y0, y1) from memory if the image is kept in a scratch
+ * file.  Rows that are accessed again are read back from the file.
+ */
+void image::evictRows(int y0, int y1)
+{
+    y0 = max(0, y0);
+    y1 = min(height, y1);
+    if (!pooled || !pool->mapped() || y1 <= y0)
+        return;
+    if (planes == NULL)
+    {
+        pool->evict(data + (size_t)y0 * width, (size_t)(y1 - y0) * width * sizeof(t_fpixel));
+        return;
+    }
+    size_t channelBytes = compact ? sizeof(unsigned short) : sizeof(float);
+    for (int c = 0; c < 4; c++)
+        pool->evict((char*)planes + ((size_t)c * height + y0) * width * channelBytes,
+                    (size_t)(y1 - y0) * width * channelBytes);
+}
+
+/*
+ * Decodes the image strip by strip or tile by tile, so that only one strip or
+ * tile is held in the form of the file at a time.  Contiguous RGB and RGBA
+ * files with 8 or 16 bit integer or 32 bit float samples are decoded with
+ * TIFFReadEncodedStrip() and TIFFReadEncodedTile(), which leave the samples
+ * as they are, and converted by the decodeRow() for their sample type; their
+ * rows come top row first.  Other files are read through the 8 bit RGBA
+ * interface of libtiff, which delivers each strip or tile with the bottom row
+ * first.  The rows are stored directly at their place in the image, whose
+ * row 0 is the bottom row.  The alpha ranges of planar images are recorded
+ * as soon as a band of rows is complete.
+ */
+bool image::loadTIFF(TIFF* tif)
+{
+    uint16 bits, sampleFormat, samples, planarConfig, orientation, extraSamples;
+    uint16 photometric = 0;
+    uint16* extra;
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &sampleFormat);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planarConfig);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ORIENTATION, &orientation);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_EXTRASAMPLES, &extraSamples, &extra);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+    bool integer = sampleFormat == SAMPLEFORMAT_UINT && (bits == 8 || bits == 16);
+    bool floating = sampleFormat == SAMPLEFORMAT_IEEEFP && bits == 32;
+    fileFormat = floating ? FORMAT_FLOAT : integer && bits == 16 ? FORMAT_RGBA16 : FORMAT_RGBA8;
+    // a fourth sample without an extra sample tag is associated alpha to
+    // libtiff; unassociated 8 bit alpha is left to libtiff, whose rounding
+    // the references of the tests depend on
+    bool unassociated = extraSamples > 0 && extra[0] == EXTRASAMPLE_UNASSALPHA;
+    bool native = (integer || floating) && planarConfig == PLANARCONFIG_CONTIG && photometric == PHOTOMETRIC_RGB
+               && orientation == ORIENTATION_TOPLEFT && (samples == 3 || samples == 4)
+               && !(bits == 8 && unassociated);
+    t_decodeRow decode = decodeRow<unsigned char, 4>;
+    if (native && bits == 8)
+        decode = samples == 3 ? decodeRow<unsigned char, 3> : decodeRow<unsigned char, 4>;
+    else if (native && bits == 16)
+        decode = samples == 3 ? decodeRow<unsigned short, 3> : decodeRow<unsigned short, 4>;
+    else if (native)
+        decode = samples == 3 ? decodeRow<float, 3> : decodeRow<float, 4>;
+    if (!native)
+        unassociated = false;
+    size_t pixelBytes = native ? (size_t)samples * bits / 8 : sizeof(t_pixel);
+
+    uint32 chunkWidth = width;
+    uint32 chunkHeight;
+    bool tiled = TIFFIsTiled(tif);
+    if (tiled)
+    {
+        TIFFGetField(tif, TIFFTAG_TILEWIDTH, &chunkWidth);
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &chunkHeight);
+    }
+    else
+    {
+        TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &chunkHeight);
+        chunkHeight = min(chunkHeight, (uint32)height);
+    }
+    vector<char> raster((size_t)chunkWidth * chunkHeight * pixelBytes);
+    for (int y0 = 0; y0 < height; y0 += chunkHeight)
+    {
+        int rows = min((int)chunkHeight, height - y0);
+        for (int x0 = 0; x0 < width; x0 += chunkWidth)
+        {
+            int columns = min((int)chunkWidth, width - x0);
+            // partial tiles of libtiff's RGBA interface are aligned to the
+            // bottom of the raster, partial strips to its top
+            int bottom = tiled ? chunkHeight : rows;
+            size_t needed = ((size_t)(rows - 1) * chunkWidth + columns) * pixelBytes;
+            if (native && tiled)
+            {
+                if (TIFFReadEncodedTile(tif, TIFFComputeTile(tif, x0, y0, 0, 0), raster.data(), raster.size())
+                    < (tmsize_t)needed)
+                    return false;
+            }
+            else if (native)
+            {
+                if (TIFFReadEncodedStrip(tif, TIFFComputeStrip(tif, y0, 0), raster.data(), raster.size())
+                    < (tmsize_t)needed)
+                    return false;
+            }
+            else if (tiled ? !TIFFReadRGBATile(tif, x0, y0, (uint32*) raster.data())
+                           : !TIFFReadRGBAStrip(tif, y0, (uint32*) raster.data()))
+                return false;
+            for (int i = 0; i < rows; i++)
+            {
+                int row = native ? i : bottom - 1 - i;
+                decode(this, height - 1 - (y0 + i), x0, columns, &raster[(size_t)row * chunkWidth * pixelBytes],
+                       unassociated);
+            }
+        }
+        if (planes != NULL)
+        {
+            for (int i = 0; i < rows; i++)
+                coverRow(height - 1 - (y0 + i), 0, width);
+        }
+        evictRows(height - y0 - rows, height - y0);
+    }
+    return true;
+}
+
+image::~image()
+{
+    if (manageData)
+    {
+        delete[] data;
+        delete[] planes;
+    }
+    if (pooled)
+        pool->release(planes != NULL ? (void*)planes : (void*)data);
+}
+
+/*
+ * Returns row y of channel c (red, green, blue, alpha) of a planar image.
+ */
+float* image::plane(int c, int y)
+{
+    return planes + ((size_t)c * height + y) * width;
+}
+
+/*
+ * Returns row y of channel c of a compact image.
+ */
+unsigned short* image::plane16(int c, int y)
+{
+    return (unsigned short*)planes + ((size_t)c * height + y) * width;
+}
+
+t_fpixel image::pixel(int x, int y)
+{
+    if (planes == NULL)
+        return data[y * width + x];
+    if (compact)
+    {
+        t_fpixel p = {unpack16(plane16(0, y)[x]), unpack16(plane16(1, y)[x]),
+                      unpack16(plane16(2, y)[x]), unpack16(plane16(3, y)[x])};
+        return p;
+    }
+    t_fpixel p = {plane(0, y)[x], plane(1, y)[x], plane(2, y)[x], plane(3, y)[x]};
+    return p;
+}
+
+void image::setPixel(int x, int y, const t_fpixel& p)
+{
+    if (planes == NULL)
+        data[(size_t)y * width + x] = p;
+    else if (compact)
+    {
+        plane16(0, y)[x] = pack16(p.r);
+        plane16(1, y)[x] = pack16(p.g);
+        plane16(2, y)[x] = pack16(p.b);
+        plane16(3, y)[x] = pack16(p.a);
+    }
+    else
+    {
+        plane(0, y)[x] = p.r;
+        plane(1, y)[x] = p.g;
+        plane(2, y)[x] = p.b;
+        plane(3, y)[x] = p.a;
+    }
+}
+
+/*
+ * Sets the fields that describe RGBA pixels with samples of the given format
+ * compressed with the selected codec.
+ */
+static void setOutputFields(TIFF* tif, int width, int height, int compression, t_format format)
+{
+    uint16 extra = EXTRASAMPLE_ASSOCALPHA;
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 4);
+    TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, 1, &extra);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, format == FORMAT_RGBA8 ? 8 : format == FORMAT_RGBA16 ? 16 : 32);
+    if (format == FORMAT_FLOAT)
+        TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+    TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, compression);
+    if (compression != COMPRESSION_NONE)
+        TIFFSetField(tif, TIFFTAG_PREDICTOR, format == FORMAT_FLOAT ? PREDICTOR_FLOATINGPOINT : PREDICTOR_HORIZONTAL);
+}
+
+/*
+ * Returns the compressed form of a strip or tile of columns × rows pixels.
+ * Each call uses its own TIFF handle in memory, so that strips and tiles can
+ * be compressed on several threads with any codec of libtiff.
+ */
+static vector<char> encodeChunk(vector<char>& pixels, int columns, int rows, bool tile, int compression,
+                                t_format format)
+{
+    if (compression == COMPRESSION_NONE)
+        return pixels;
+    t_memfile f;
+    f.position = 0;
+    TIFF* tif = TIFFClientOpen("", "w", (thandle_t)&f, memRead, memWrite, memSeek, memClose, memSize, memMap, memUnmap);
+    vector<char> result;
+    if (!tif)
+        return result;
+    setOutputFields(tif, columns, rows, compression, format);
+    toff_t* offsets;
+    toff_t* sizes;
+    if (tile)
+    {
+        TIFFSetField(tif, TIFFTAG_TILEWIDTH, columns);
+        TIFFSetField(tif, TIFFTAG_TILELENGTH, rows);
+        TIFFWriteEncodedTile(tif, 0, pixels.data(), pixels.size());
+        TIFFGetField(tif, TIFFTAG_TILEOFFSETS, &offsets);
+        TIFFGetField(tif, TIFFTAG_TILEBYTECOUNTS, &sizes);
+    }
+    else
+    {
+        TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows);
+        TIFFWriteEncodedStrip(tif, 0, pixels.data(), pixels.size());
+        TIFFGetField(tif, TIFFTAG_STRIPOFFSETS, &offsets);
+        TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &sizes);
+    }
+    result.assign(f.bytes.begin() + offsets[0], f.bytes.begin() + offsets[0] + sizes[0]);
+    TIFFClose(tif);
+    return result;
+}
+
+/*
+ * Writes size bytes at p to the standard output.
+ */
+static bool writeOut(const char* p, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/*
+ * Appends the lowest `bytes` bytes of v to b, least significant first.
+ */
+static void putLittle(vector<char>& b, unsigned long long v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        b.push_back((char)(v >> (8 * i)));
+}
+
+/*
+ * A field of a TIFF directory.
+ */
+struct t_tiffField
+{
+    unsigned short tag;
+    unsigned short type;
+    vector<unsigned long long> values;
+};
+
+/*
+ * Returns the size of a value of the given TIFF type; the directory of
+ * uncompressedDirectory() only holds SHORT, LONG and LONG8 values.
+ */
+static int typeBytes(unsigned short type)
+{
+    return type == TIFF_SHORT ? 2 : type == TIFF_LONG ? 4 : 8;
+}
+
+/*
+ * Returns the header and the directory of a little endian, uncompressed RGBA
+ * TIFF file with the fields of setOutputFields(), directly followed by its
+ * chunks strips or tiles of chunkWidth × chunkHeight pixels in order, the
+ * last strip cut to the height of the image.  Since nothing about them is
+ * left to find out, the directory can precede them, so that a pipe receives
+ * them as they are encoded.
+ */
+static vector<char> uncompressedDirectory(int width, int height, t_format format, bool big, bool tiled,
+                                          int chunkWidth, int chunkHeight, int chunks)
+{
+    int bits = format == FORMAT_RGBA8 ? 8 : format == FORMAT_RGBA16 ? 16 : 32;
+    unsigned short offsetType = big ? TIFF_LONG8 : TIFF_LONG;
+    vector<unsigned long long> sizes(chunks);
+    for (int i = 0; i < chunks; i++)
+        sizes[i] = (unsigned long long)chunkWidth * (tiled ? chunkHeight : min(chunkHeight, height - i * chunkHeight))
+                   * 4 * bits / 8;
+    vector<t_tiffField> fields;
+    auto add = [&](unsigned short tag, unsigned short type, const vector<unsigned long long>& values)
+    {
+        t_tiffField f = {tag, type, values};
+        fields.push_back(f);
+    };
+    // in ascending order of their tags
+    add(TIFFTAG_IMAGEWIDTH, TIFF_LONG, {(unsigned long long)width});
+    add(TIFFTAG_IMAGELENGTH, TIFF_LONG, {(unsigned long long)height});
+    add(TIFFTAG_BITSPERSAMPLE, TIFF_SHORT, vector<unsigned long long>(4, bits));
+    add(TIFFTAG_COMPRESSION, TIFF_SHORT, {COMPRESSION_NONE});
+    add(TIFFTAG_PHOTOMETRIC, TIFF_SHORT, {PHOTOMETRIC_RGB});
+    if (!tiled)
+        add(TIFFTAG_STRIPOFFSETS, offsetType, sizes);
+    add(TIFFTAG_ORIENTATION, TIFF_SHORT, {ORIENTATION_TOPLEFT});
+    add(TIFFTAG_SAMPLESPERPIXEL, TIFF_SHORT, {4});
+    if (!tiled)
+    {
+        add(TIFFTAG_ROWSPERSTRIP, TIFF_LONG, {(unsigned long long)chunkHeight});
+        add(TIFFTAG_STRIPBYTECOUNTS, offsetType, sizes);
+    }
+    add(TIFFTAG_PLANARCONFIG, TIFF_SHORT, {PLANARCONFIG_CONTIG});
+    if (tiled)
+    {
+        add(TIFFTAG_TILEWIDTH, TIFF_LONG, {(unsigned long long)chunkWidth});
+        add(TIFFTAG_TILELENGTH, TIFF_LONG, {(unsigned long long)chunkHeight});
+        add(TIFFTAG_TILEOFFSETS, offsetType, sizes);
+        add(TIFFTAG_TILEBYTECOUNTS, offsetType, sizes);
+    }
+    add(TIFFTAG_EXTRASAMPLES, TIFF_SHORT, {EXTRASAMPLE_ASSOCALPHA});
+    if (format == FORMAT_FLOAT)
+        add(TIFFTAG_SAMPLEFORMAT, TIFF_SHORT, vector<unsigned long long>(4, SAMPLEFORMAT_IEEEFP));
+
+    // the values that do not fit into their entries follow the directory
+    int word = big ? 8 : 4;
+    size_t header = big ? 16 : 8;
+    size_t end = header + (big ? 8 + 20 * fields.size() + 8 : 2 + 12 * fields.size() + 4);
+    vector<size_t> at(fields.size(), 0);
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        size_t bytes = fields[i].values.size() * typeBytes(fields[i].type);
+        if (bytes > (size_t)word)
+        {
+            at[i] = end;
+            end += (bytes + 1) & ~(size_t)1;
+        }
+    }
+    // the strips or tiles follow the values
+    unsigned long long offset = end;
+    for (size_t i = 0; i < fields.size(); i++)
+        if (fields[i].tag == TIFFTAG_STRIPOFFSETS || fields[i].tag == TIFFTAG_TILEOFFSETS)
+            for (int j = 0; j < chunks; j++)
+            {
+                fields[i].values[j] = offset;
+                offset += sizes[j];
+            }
+
+    vector<char> b;
+    b.push_back('I');
+    b.push_back('I');
+    putLittle(b, big ? 43 : 42, 2);
+    if (big)
+    {
+        putLittle(b, 8, 2);
+        putLittle(b, 0, 2);
+    }
+    putLittle(b, header, word);
+    putLittle(b, fields.size(), big ? 8 : 2);
+    vector<char> values;
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        const t_tiffField& f = fields[i];
+        int size = typeBytes(f.type);
+        vector<char>& v = at[i] != 0 ? values : b;
+        putLittle(b, f.tag, 2);
+        putLittle(b, f.type, 2);
+        putLittle(b, f.values.size(), word);
+        if (at[i] != 0)
+            putLittle(b, at[i], word);
+        size_t start = v.size();
+        for (size_t j = 0; j < f.values.size(); j++)
+            putLittle(v, f.values[j], size);
+        // inline values are padded to a word, those behind to an even size
+        size_t used = v.size() - start;
+        putLittle(v, 0, at[i] != 0 ? used % 2 : word - used);
+    }
+    putLittle(b, 0, word);
+    b.insert(b.end(), values.begin(), values.end());
+    return b;
+}
+
+/*
+ * Saves the image as RGBA TIFF file with samples of the given format, as
+ * BigTIFF file if the pixels alone take almost 4 GB, or to the standard
+ * output if s is "-".  The strips or tiles are quantized and compressed on
+ * the worker threads in batches of a few per thread and then written in
+ * order.  Uncompressed files reach the standard output batch by batch behind
+ * a directory written in advance, see uncompressedDirectory().  Compressed
+ * ones are held in memory until they are complete, since the directory that
+ * the header points to lists the sizes of all strips or tiles.
+ */
+bool image::saveToTIFF(const char* s, t_format format)
+{
+    size_t pixelBytes = 4 * (format == FORMAT_RGBA8 ? 1 : format == FORMAT_RGBA16 ? 2 : 4);
+    void (*encode)(image* img, int y, int x0, int columns, void* pixels) = format == FORMAT_RGBA8
+        ? encodeRow<unsigned char> : format == FORMAT_RGBA16 ? encodeRow<unsigned short> : encodeRow<float>;
+    bool big = (unsigned long long)width * height * pixelBytes > CLASSIC_TIFF_BYTES;
+    bool streamed = strcmp(s, "-") == 0;
+    bool progressive = streamed && context->compression == COMPRESSION_NONE;
+    int chunkWidth = width;
+    int chunkHeight;
+    bool tiled = context->tiledOutput;
+    if (tiled)
+        chunkWidth = chunkHeight = OUTPUT_TILE;
+    else
+        chunkHeight = min(height, max(1, OUTPUT_STRIP_BYTES / (int)(width * pixelBytes)));
+    int chunksX = (width + chunkWidth - 1) / chunkWidth;
+    int chunks = chunksX * ((height + chunkHeight - 1) / chunkHeight);
+    t_memfile out;
+    out.position = 0;
+    TIFF* tif2 = NULL;
+    bool ok = true;
+    if (progressive)
+    {
+        vector<char> directory = uncompressedDirectory(width, height, format, big, tiled, chunkWidth, chunkHeight,
+                                                       chunks);
+        ok = writeOut(directory.data(), directory.size());
+    }
+    else
+    {
+        tif2 = streamed ? TIFFClientOpen(s, big ? "w8" : "w", (thandle_t)&out, memRead, memWrite, memSeek, memClose,
+                                         memSize, memMap, memUnmap)
+                        : TIFFOpen(s, big ? "w8" : "w");
+        if (!tif2)
+            return false;
+        setOutputFields(tif2, width, height, context->compression, format);
+        if (tiled)
+        {
+            TIFFSetField(tif2, TIFFTAG_TILEWIDTH, chunkWidth);
+            TIFFSetField(tif2, TIFFTAG_TILELENGTH, chunkHeight);
+        }
+        else
+            TIFFSetField(tif2, TIFFTAG_ROWSPERSTRIP, chunkHeight);
+    }
+    int batch = context->threads * 4;
+    int evicted = 0;
+    for (int first = 0; first < chunks && ok; first += batch)
+    {
+        int n = min(batch, chunks - first);
+        vector<vector<char> > encoded(n);
+        forEachRowBand(context, n, [&](int i0, int i1, int)
+        {
+            vector<char> temp;
+            for (int i = i0; i < i1; i++)
+            {
+                int x0 = (first + i) % chunksX * chunkWidth;
+                int y0 = (first + i) / chunksX * chunkHeight;
+                int rows = tiled ? chunkHeight : min(chunkHeight, height - y0);
+                temp.assign((size_t)chunkWidth * rows * pixelBytes, 0);
+                for (int y = y0; y < min(height, y0 + rows); y++)
+                    encode(this, height - y - 1, x0, min(width, x0 + chunkWidth) - x0,
+                           &temp[(size_t)(y - y0) * chunkWidth * pixelBytes]);
+                encoded[i] = encodeChunk(temp, chunkWidth, rows, tiled, context->compression, format);
+            }
+        });
+        for (int i = 0; i < n && ok; i++)
+        {
+            if (progressive)
+                ok = writeOut(encoded[i].data(), encoded[i].size());
+            else if (tiled)
+                ok = TIFFWriteRawTile(tif2, first + i, encoded[i].data(), encoded[i].size()) != -1;
+            else
+                ok = TIFFWriteRawStrip(tif2, first + i, encoded[i].data(), encoded[i].size()) != -1;
+            ok = ok && !encoded[i].empty();
+        }
+        // the file rows of complete rows of chunks are not read again
+        int written = min(height, (first + n) / chunksX * chunkHeight);
+        evictRows(height - written, height - evicted);
+        evicted = written;
+    }
+    if (tif2 != NULL)
+        TIFFClose(tif2);
+    if (streamed && !progressive)
+        ok = ok && writeOut(out.bytes.data(), out.bytes.size());
+    return ok;
+}
+
+/*
+ * Copies the image to memory in the layout that the constructor for images
+ * in memory reads.  Integer channels are quantized like in saveToTIFF().
+ */
+void image::saveToBuffer(void* pixels, ptrdiff_t stride, t_format format)
+{
+    forEachRowBand(context, height, [&](int y0, int y1, int)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            char* row = (char*)pixels + (height - 1 - y) * stride;
+            if (format == FORMAT_RGBA8)
+                encodeRow<unsigned char>(this, y, 0, width, row);
+            else if (format == FORMAT_RGBA16)
+                encodeRow<unsigned short>(this, y, 0, width, row);
+            else
+            {
+                for (int x = 0; x < width; x++)
+                    ((t_fpixel*)row)[x] = pixel(x, y);
+            }
+        }
+    }, false, evictor([&](int y0, int y1) { evictRows(y0, y1); }));
+}
+
+/*
+ * Horizontal taps of the half size filter in row y of an output image of
+ * height h.  The filter widens towards the poles, except in flat images,
+ * which are local projections without any.  Output column x reads source
+ * columns 2x + u with u in [first, last]; tapRuns() lists the exact taps.
+ */
+struct t_taps
+{
+    float fw;
+    int first;
+    int last;
+};
+
+static t_taps blurTaps(int y, int h, bool flat)
+{
+    t_taps t;
+    t.fw = flat ? 4 : 4.0 / (cos((0.5 + (double)y - (double)h / 2) / (double)h * PI));
+    t.first = floor(1 - (double)t.fw);
+    t.last = ceil((double)t.fw);
+    return t;
+}
+
+/*
+ * Sets offsets to the taps of output column x relative to 2x.  They start at
+ * 2x + 1 - fw and advance by fw / 4, in single precision and truncated
+ * towards zero like the filter has always placed them, so that they shift
+ * a little near column 0 and where 2x crosses a power of two.
+ */
+static void tapOffsets(float fw, int x, vector<int>& offsets)
+{
+    offsets.clear();
+    for (int u = x * 2 + 1 - fw; u <= x * 2 + fw; u += fw / 4)
+        offsets.push_back(u - x * 2);
+}
+
+/*
+ * Returns whether output column x certainly has the taps of column x - 1:
+ * all values that tapOffsets() rounds for both lie in one binade of
+ * positive floats fine enough that moving them by 2 keeps their roundings.
+ */
+static bool sameTaps(const t_taps& t, int x)
+{
+    int lo = 2 * x - 3 + t.first;
+    int hi = 2 * x + t.last + (int)(t.fw / 4) + 2;
+    return lo > 0 && hi < (1 << 23) && (lo ^ hi) < lo;
+}
+
+/*
+ * Lists the taps of the output columns [x0, x1) of a row in runs.
+ */
+static void tapRuns(const t_taps& t, int x0, int x1, t_tapRuns& runs)
+{
+    runs.start.clear();
+    runs.first.clear();
+    runs.offsets.clear();
+    runs.weights.clear();
+    runs.sums.clear();
+    for (int x = x0; x < x1; x++)
+    {
+        if (x > x0 && sameTaps(t, x))
+            continue;
+        tapOffsets(t.fw, x, runs.next);
+        if (x > x0 && runs.offsets.size() - runs.first.back() == runs.next.size() &&
+            equal(runs.next.begin(), runs.next.end(), runs.offsets.begin() + runs.first.back()))
+            continue;
+        runs.start.push_back(x);
+        runs.first.push_back(runs.offsets.size());
+        float sum = 0;
+        for (size_t j = 0; j < runs.next.size(); j++)
+        {
+            float dx = ((float)runs.next[j] - 0.5) / t.fw;
+            float weightx = 1 + dx*dx*dx*dx - 2*dx*dx;
+            runs.offsets.push_back(runs.next[j]);
+            runs.weights.push_back(weightx);
+            sum += weightx;
+        }
+        runs.sums.push_back(sum);
+    }
+    runs.start.push_back(x1);
+    runs.first.push_back(runs.offsets.size());
+}
+
+image* image::blurredHalfSize()
+{
+    if (planes != NULL)
+        return blurredHalfSizePlanar();
+    int w = (width + 1) / 2;
+    int h = (height + 1) / 2;
+    t_fpixel* temp = (t_fpixel*)pool->allocate((size_t)w * h * sizeof(t_fpixel));
+    forEachRowBand(context, h, [&](int y0, int y1, int)
+    {
+        vector<t_fpixel> column(width);
+        vector<t_fpixel> row;
+        t_tapRuns runs;
+        for (int y = y0; y < y1; y++)
+        {
+            t_taps t = blurTaps(y, h, flat);
+
+            // vertical part of the filter, mirrored across the poles
+            float weights = 0;
+            for (int p = 0; p < width; p++)
+                column[p].r = column[p].g = column[p].b = column[p].a = 0;
+            for (int v = y * 2 - 3; v <= y * 2 + 4; v++)
+            {
+                float dy = ((float)(v - y * 2) - 0.5) / 4;
+                float weighty = 1 + dy*dy*dy*dy - 2*dy*dy;
+                int q = v;
+                bool mirror = false;
+                if (q < 0)
+                {
+                    q = -1 - q;
+                    mirror = !mirror;
+                }
+                if (q >= height)
+                {
+                    q = 2 * height - q - 1;
+                    mirror = !mirror;
+                }
+                if (q < 0)
+                    q = 0;
+                if (q >= height)
+                    q = height - 1;
+                t_fpixel* src = data + q * width;
+                for (int p = 0; p < width; p++)
+                {
+                    t_fpixel& s = src[mirror ? width - p - 1 : p];
+                    column[p].r += s.r * s.a * weighty;
+                    column[p].g += s.g * s.a * weighty;
+                    column[p].b += s.b * s.a * weighty;
+                    column[p].a += s.a * weighty;
+                }
+                weights += weighty;
+            }
+
+            // wrap the row around so that no tap needs a range check
+            int n = 2 * (w - 1) + t.last + 1 - t.first;
+            row.resize(n);
+            for (int i = 0; i < n; i++)
+                row[i] = column[((i + t.first) % width + width) % width];
+
+            tapRuns(t, 0, w, runs);
+            for (size_t k = 0; k < runs.sums.size(); k++)
+            {
+                float total = weights * runs.sums[k];
+                for (int x = runs.start[k]; x < runs.start[k + 1]; x++)
+                {
+                    float r = 0;
+                    float g = 0;
+                    float b = 0;
+                    float a = 0;
+                    for (int j = runs.first[k]; j < runs.first[k + 1]; j++)
+                    {
+                        t_fpixel& s = row[x * 2 + runs.offsets[j] - t.first];
+                        float weightx = runs.weights[j];
+                        r += s.r * weightx;
+                        g += s.g * weightx;
+                        b += s.b * weightx;
+                        a += s.a * weightx;
+                    }
+                    temp[y * w + x].a = a / total;
+                    if (a != 0)
+                    {
+                        temp[y * w + x].r = r / a;
+                        temp[y * w + x].g = g / a;
+                        temp[y * w + x].b = b / a;
+                    }
+                    else
+                    {
+                        temp[y * w + x].r = 0;
+                        temp[y * w + x].g = 0;
+                        temp[y * w + x].b = 0;
+                    }
+                }
+            }
+        }
+    }, true, evictor([&](int y0, int y1)
+    {
+        evictRows(2 * y0 - 3, 2 * y1 - 3);
+        pool->evict(temp + (size_t)y0 * w, (size_t)(y1 - y0) * w * sizeof(t_fpixel));
+    }));
+    image* result = new image(context, w, h, temp);
+    result->pool = pool;
+    result->pooled = true;
+    result->flat = flat;
+    return result;
+}
+
+/*
+ * Returns pixel (x, y) of the double size image using nearest neighbour
+ * interpolation.
+ */
+t_fpixel image::upsampledN(int x, int y)
+{
+    return data[(y / 2) * width + (x / 2)];
+}
+
+/*
+ * Returns pixel (x, y) of the double size image using bilinear
+ * interpolation.  Columns wrap around, rows are clamped at the poles.
+ */
+t_fpixel image::upsampledL(int x, int y)
+{
+    int xs = x / 2;
+    int ys = y / 2;
+    int xn = x % 2 ? (xs + 1) % width : (xs + width - 1) % width;
+    int yn = y % 2 ? min(height - 1, ys + 1) : max(0, ys - 1);
+    t_fpixel p = data[ys * width + xs];
+    t_fpixel pxn = data[ys * width + xn];
+    t_fpixel pyn = data[yn * width + xs];
+    t_fpixel pd = data[yn * width + xn];
+    t_fpixel result;
+    result.r = (p.r * 9 + pyn.r * 3 + pd.r * 1 + pxn.r * 3) / 16;
+    result.g = (p.g * 9 + pyn.g * 3 + pd.g * 1 + pxn.g * 3) / 16;
+    result.b = (p.b * 9 + pyn.b * 3 + pd.b * 1 + pxn.b * 3) / 16;
+    result.a = (p.a * 9 + pyn.a * 3 + pd.a * 1 + pxn.a * 3) / 16;
+    return result;
+}
+
+/*
+ * Blends the double size of img into this image.  The interpolated pixels
+ * are computed where they are blended, so the double size image is never
+ * stored.
+ */
+void image::alphaBlendUpsampled(image* img)
+{
+    if (planes != NULL)
+        return alphaBlendUpsampledPlanar(img);
+    forEachRowBand(context, height, [&](int y0, int y1, int)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                t_fpixel p = context->interpolator == 1 ? img->upsampledL(x, y) : img->upsampledN(x, y);
+                int alpha = data[y * width + x].a;
+                data[y * width + x].r = data[y * width + x].r * alpha + p.r * (1.0 - alpha);
+                data[y * width + x].g = data[y * width + x].g * alpha + p.g * (1.0 - alpha);
+                data[y * width + x].b = data[y * width + x].b * alpha + p.b * (1.0 - alpha);
+                data[y * width + x].a = alpha + p.a * (1.0 - alpha);
+            }
+        }
+    }, false, evictor([&](int y0, int y1)
+    {
+        evictRows(y0, y1);
+        img->evictRows(y0 / 2 - 1, y1 / 2 - 1);
+    }));
+}
+
+void image::correctAlpha()
+{
+    if (planes != NULL)
+        return correctAlphaPlanar();
+    forEachRowBand(context, height, [&](int y0, int y1, int)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                data[y * width + x].a = min(1.0f, data[y * width + x].a * 5);
+            }
+        }
+    }, false, evictor([&](int y0, int y1) { evictRows(y0, y1); }));
+}
+
+/*
+ * Returns true if every pixel is fully transparent.  Planar images only
+ * check the alpha ranges of their tiles; tiles that have not been computed
+ * are opaque.
+ */
+bool image::onlyTransparentPixels()
+{
+    if (planes != NULL)
+    {
+        for (size_t t = 0; t < valid.size(); t++)
+        {
+            if (!valid[t] || alphaMax[t] != 0)
+                return false;
+        }
+        return true;
+    }
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            if (data[y * width + x].a != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Returns the number of pixels that are not fully opaque.  Tiles of planar
+ * images that have not been computed are opaque.
+ */
+long long image::transparentPixels()
+{
+    long long n = 0;
+    if (planes != NULL)
+    {
+        // only the rows of tiles that are neither opaque nor fully
+        // transparent are counted pixel by pixel
+        vector<t_span> spans = tileSpans(holes);
+        for (size_t i = 0; i < spans.size(); i++)
+        {
+            float* a = plane(3, spans[i].y);
+            unsigned short* a16 = plane16(3, spans[i].y);
+            for (int tx = spans[i].x0 / TILE_WIDTH; tx * TILE_WIDTH < spans[i].x1; tx++)
+            {
+                int x0 = tx * TILE_WIDTH;
+                int x1 = min(spans[i].x1, x0 + TILE_WIDTH);
+                size_t r = (size_t)spans[i].y * tilesX + tx;
+                if (rowMax[r] == 0)
+                    n += x1 - x0;
+                else if (rowMin[r] != 1.0 || rowMax[r] != 1.0)
+                {
+                    for (int x = x0; x < x1; x++)
+                        n += compact ? a16[x] != 65535 : a[x] != 1.0;
+                }
+            }
+        }
+        return n;
+    }
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+            n += data[y * width + x].a != 1.0;
+    }
+    return n;
+}
+
+/*
+ * Returns the runs of pixels in which transparent pixels remain, one per
+ * pixel row, with row 0 at the top as in the file.  Planar images report
+ * them with the accuracy of a tile column and only in the tiles that are
+ * holes, which a fill limited to a region restricts.
+ */
+vector<t_span> image::holeSpans()
+{
+    vector<t_span> spans;
+    for (int y = height - 1; y >= 0; y--)
+    {
+        int run = -1;
+        int columns = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+        for (int tx = 0; tx <= columns; tx++)
+        {
+            int x = tx * TILE_WIDTH;
+            bool hole = false;
+            if (tx < columns && planes != NULL)
+            {
+                size_t r = (size_t)y * tilesX + tx;
+                hole = holes[y / TILE_HEIGHT * tilesX + tx] && (rowMin[r] != 1.0 || rowMax[r] != 1.0);
+            }
+            else
+            {
+                for (int p = x; p < min(width, x + TILE_WIDTH) && !hole; p++)
+                    hole = data[(size_t)y * width + p].a != 1.0;
+            }
+            if (hole && run < 0)
+                run = x;
+            if (!hole && run >= 0)
+            {
+                t_span s = {height - 1 - y, run, min(width, x)};
+                spans.push_back(s);
+                run = -1;
+            }
+        }
+    }
+    return spans;
+}
+
+bool image::noTransparentPixels()
+{
+    if (planes != NULL)
+        return find(holes.begin(), holes.end(), true) == holes.end();
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            if (data[y * width + x].a != 1.0)
+                return false;
+        }
+    }
+    return true;
+}
+
+//------------------------------
+
+/*
+ * Row kernels for planar images.  They repeat the arithmetic of the scalar
+ * kernels above operation by operation, so both produce identical results,
+ * but their loops run along contiguous rows of one channel and vectorize.
+ * With GCC on x86-64 every kernel is compiled for AVX2 and for the baseline
+ * instruction set, and the dynamic loader picks the best one for the CPU.
+ */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+const char* simdName()
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        return "AVX2";
+    return "SSE2";
+#else
+    return "generic";
+#endif
+}
+
+SIMD_CLONES
+static void blurColumns(float** column, float** src, int width, int p0, int p1, bool mirror, float weighty,
+                        int channels)
+{
+    // without the alpha channel the colours are those of a plan, which
+    // leaves the colours of pixels without alpha uncomputed
+    float* a = src[3];
+    for (int c = 0; c < 3; c++)
+    {
+        float* __restrict col = column[c];
+        float* s = src[c];
+        if (channels < 4)
+        {
+            if (mirror)
+                for (int p = p0; p < p1; p++)
+                    col[p] += a[width - p - 1] != 0 ? s[width - p - 1] * a[width - p - 1] * weighty : 0;
+            else
+                for (int p = p0; p < p1; p++)
+                    col[p] += a[p] != 0 ? s[p] * a[p] * weighty : 0;
+        }
+        else if (mirror)
+            for (int p = p0; p < p1; p++)
+                col[p] += s[width - p - 1] * a[width - p - 1] * weighty;
+        else
+            for (int p = p0; p < p1; p++)
+                col[p] += s[p] * a[p] * weighty;
+    }
+    if (channels < 4)
+        return;
+    float* __restrict col = column[3];
+    if (mirror)
+        for (int p = p0; p < p1; p++)
+            col[p] += a[width - p - 1] * weighty;
+    else
+        for (int p = p0; p < p1; p++)
+            col[p] += a[p] * weighty;
+}
+
+/*
+ * The fixed point counterparts of the kernels above for compact images of a
+ * context with fixedPoint, which read and write their 16 bit rows directly.
+ * The colours are premultiplied in 16 bit lanes and summed in unsigned 32 bit
+ * lanes, the eight vertical taps of a column with weights of
+ * FIXED_WEIGHT_BITS fractional bits, which add up to less than 35000, so the
+ * columns stay below 2^32.  blurRowFixed() narrows them to 15 bit, and the
+ * horizontal taps, with one fractional bit less, add up to less than 35000
+ * as well, so their sums stay below 2^31.  Only the final normalization by
+ * the alpha sum divides in single precision.
+ */
+const int FIXED_WEIGHT_BITS = 13;
+
+static inline unsigned short fixedWeight(float weight, int bits = FIXED_WEIGHT_BITS)
+{
+    return (unsigned short)(weight * (1 << bits) + 0.5f);
+}
+
+/*
+ * Returns s * a / 65535 rounded to the nearest integer, which is off by one
+ * for a few thousand of the 2^32 pairs.  It is exactly 0 for s = 0 and s for
+ * a = 65535, so that opaque black stays black.
+ */
+static inline unsigned short premultiply16(unsigned short s, unsigned short a)
+{
+    unsigned p = (unsigned)s * a;
+    return (unsigned short)((p + (p >> 16) + 32768) >> 16);
+}
+
+SIMD_CLONES
+static void blurColumnsFixed(unsigned** column, unsigned short** src, int width, int p0, int p1, bool mirror,
+                             unsigned short weighty)
+{
+    const unsigned short* a = src[3];
+    for (int c = 0; c < 3; c++)
+    {
+        unsigned* __restrict col = column[c];
+        const unsigned short* s = src[c];
+        if (mirror)
+            for (int p = p0; p < p1; p++)
+                col[p] += (unsigned)premultiply16(s[width - p - 1], a[width - p - 1]) * weighty;
+        else
+            for (int p = p0; p < p1; p++)
+                col[p] += (unsigned)premultiply16(s[p], a[p]) * weighty;
+    }
+    unsigned* __restrict col = column[3];
+    if (mirror)
+        for (int p = p0; p < p1; p++)
+            col[p] += (unsigned)a[width - p - 1] * weighty;
+    else
+        for (int p = p0; p < p1; p++)
+            col[p] += (unsigned)a[p] * weighty;
+}
+
+SIMD_CLONES
+static unsigned columnMax(const unsigned* in, int p0, int p1, unsigned m)
+{
+    for (int p = p0; p < p1; p++)
+        m = max(m, in[p]);
+    return m;
+}
+
+/*
+ * Rounds the columns [p0, p1) of a fixed point column to 16 bit by dropping
+ * its lowest `shift` bits.
+ */
+SIMD_CLONES
+static void narrowColumn(unsigned short* __restrict out, const unsigned* in, int p0, int p1, int shift)
+{
+    unsigned half = (1u << shift) >> 1;
+    for (int p = p0; p < p1; p++)
+        out[p] = (in[p] + half) >> shift;
+}
+
+SIMD_CLONES
+static void blurTapFixed(unsigned* __restrict acc, const unsigned short* row, int n, unsigned short weightx)
+{
+    for (int x = 0; x < n; x++)
+        acc[x] += (unsigned)row[x] * weightx;
+}
+
+/*
+ * opaque scales the sum of an opaque neighbourhood to exactly 65535.  The
+ * colours are divided by their alpha sums in single precision, since an
+ * integer reciprocal of a different sum in every lane would need a division
+ * just the same.
+ */
+SIMD_CLONES
+static void blurFinishFixed(unsigned short** out, unsigned** acc, int n, float opaque)
+{
+    unsigned short* __restrict r = out[0];
+    unsigned short* __restrict g = out[1];
+    unsigned short* __restrict b = out[2];
+    unsigned short* __restrict alpha = out[3];
+    const int* sr = (const int*)acc[0];
+    const int* sg = (const int*)acc[1];
+    const int* sb = (const int*)acc[2];
+    const int* sa = (const int*)acc[3];
+    // the clamps are conditional expressions, which vectorize unlike
+    // std::min() here
+    for (int x = 0; x < n; x++)
+    {
+        float scale = 65535.0f / (sa[x] > 1 ? sa[x] : 1);
+        int v[4] = {(int)(sr[x] * scale + 0.5f), (int)(sg[x] * scale + 0.5f), (int)(sb[x] * scale + 0.5f),
+                    (int)(sa[x] * opaque + 0.5f)};
+        r[x] = v[0] < 65535 ? v[0] : 65535;
+        g[x] = v[1] < 65535 ? v[1] : 65535;
+        b[x] = v[2] < 65535 ? v[2] : 65535;
+        alpha[x] = v[3] < 65535 ? v[3] : 65535;
+    }
+}
+
+SIMD_CLONES
+static void blurTap(float* __restrict acc, const float* row, int n, float weightx)
+{
+    for (int x = 0; x < n; x++)
+        acc[x] += row[x] * weightx;
+}
+
+SIMD_CLONES
+static void blurFinish(float** out, float** acc, int n, float total)
+{
+    for (int x = 0; x < n; x++)
+    {
+        float a = acc[3][x];
+        out[3][x] = a / total;
+        out[0][x] = a != 0 ? acc[0][x] / a : 0;
+        out[1][x] = a != 0 ? acc[1][x] / a : 0;
+        out[2][x] = a != 0 ? acc[2][x] / a : 0;
+    }
+}
+
+SIMD_CLONES
+static void blurFinishColours(float** out, float** acc, const float* sums, int n)
+{
+    for (int x = 0; x < n; x++)
+    {
+        float a = sums[x];
+        out[0][x] = a != 0 ? acc[0][x] / a : 0;
+        out[1][x] = a != 0 ? acc[1][x] / a : 0;
+        out[2][x] = a != 0 ? acc[2][x] / a : 0;
+    }
+}
+
+/*
+ * Splits v (length n) into its even and odd elements, so that taps with a
+ * stride of two pixels become contiguous reads.
+ */
+template <class T>
+static void deinterleave(vector<T>& even, vector<T>& odd, const T* v, int n)
+{
+    even.resize((n + 1) / 2);
+    odd.resize(n / 2 + 1);
+    T* __restrict e = even.data();
+    T* __restrict o = odd.data();
+    for (int i = 0; i < n / 2; i++)
+    {
+        e[i] = v[i * 2];
+        o[i] = v[i * 2 + 1];
+    }
+    if (n % 2)
+        e[n / 2] = v[n - 1];
+}
+
+/*
+ * Fills row (length n) with the periodic continuation of col (length width),
+ * starting at column -pad.
+ */
+template <class T>
+static void wrapRow(T* row, const T* col, int width, int pad, int n)
+{
+    int p = ((-pad) % width + width) % width;
+    for (int i = 0; i < n; )
+    {
+        int len = min(n - i, width - p);
+        copy(col + p, col + p + len, row + i);
+        i += len;
+        p = 0;
+    }
+}
+
+/*
+ * Returns the source row that the half size filter reads for tap row v in
+ * an image of the given height; rows beyond the borders are mirrored, which
+ * also mirrors the columns.
+ */
+static int tapRow(int v, int height, bool& mirror)
+{
+    int q = v;
+    mirror = false;
+    if (q < 0)
+    {
+        q = -1 - q;
+        mirror = !mirror;
+    }
+    if (q >= height)
+    {
+        q = 2 * height - q - 1;
+        mirror = !mirror;
+    }
+    return max(0, min(height - 1, q));
+}
+
+//------------------------------
+
+/*
+ * Planar images are divided into tiles of TILE_WIDTH × TILE_HEIGHT pixels.
+ * Each tile records whether it has been computed and the range of its alpha
+ * values, which tells whether it contains pixels that are not fully opaque.
+ * Tiles are flat so that tiles near the poles, whose footprints span the
+ * full width, stay few.  Downsampling only computes the tiles whose filter
+ * footprint reaches a hole; every other tile of the half size image would be
+ * exactly opaque and is only computed if a later pass actually reads it.
+ *
+ * The alpha range is also kept for the part of every pixel row inside each
+ * tile.  The kernels record it with coverRow() right after they write a row,
+ * while it is still in the cache, and summarizeTiles() combines the rows of
+ * a tile, so that no kernel needs a separate pass over the alpha plane.
+ *
+ * A fill limited to a region, see t_region, only treats the tiles in scope
+ * as holes, if scope is not empty.
+ */
+
+void image::initTiles(bool computed)
+{
+    tilesX = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+    tilesY = (height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    valid.assign(tilesX * tilesY, computed);
+    holes.assign(tilesX * tilesY, false);
+    alphaMin.assign(tilesX * tilesY, 1.0f);
+    alphaMax.assign(tilesX * tilesY, 1.0f);
+    rowMin.assign((size_t)height * tilesX, 1.0f);
+    rowMax.assign((size_t)height * tilesX, 1.0f);
+}
+
+SIMD_CLONES
+static void alphaRange(const float* a, int n, float& lo, float& hi)
+{
+    // eight independent lanes, so that the loop vectorizes without having to
+    // reorder the comparisons
+    float l[8], h[8];
+    for (int k = 0; k < 8; k++)
+        l[k] = h[k] = a[0];
+    int x = 0;
+    for (; x + 8 <= n; x += 8)
+    {
+        for (int k = 0; k < 8; k++)
+        {
+            l[k] = min(l[k], a[x + k]);
+            h[k] = max(h[k], a[x + k]);
+        }
+    }
+    for (; x < n; x++)
+    {
+        l[0] = min(l[0], a[x]);
+        h[0] = max(h[0], a[x]);
+    }
+    lo = *min_element(l, l + 8);
+    hi = *max_element(h, h + 8);
+}
+
+SIMD_CLONES
+static void alphaRange16(const unsigned short* a, int n, float& lo, float& hi)
+{
+    unsigned short l[16], h[16];
+    for (int k = 0; k < 16; k++)
+        l[k] = h[k] = a[0];
+    int x = 0;
+    for (; x + 16 <= n; x += 16)
+    {
+        for (int k = 0; k < 16; k++)
+        {
+            l[k] = min(l[k], a[x + k]);
+            h[k] = max(h[k], a[x + k]);
+        }
+    }
+    for (; x < n; x++)
+    {
+        l[0] = min(l[0], a[x]);
+        h[0] = max(h[0], a[x]);
+    }
+    lo = unpack16(*min_element(l, l + 16));
+    hi = unpack16(*max_element(h, h + 16));
+}
+
+/*
+ * Records the alpha range of the pixels [x0, x1) of row y, which must start
+ * at a tile boundary and end at one or at the right border.
+ */
+void image::coverRow(int y, int x0, int x1)
+{
+    for (int tx = x0 / TILE_WIDTH; tx * TILE_WIDTH < x1; tx++)
+    {
+        int p0 = tx * TILE_WIDTH;
+        int p1 = min(x1, p0 + TILE_WIDTH);
+        size_t r = (size_t)y * tilesX + tx;
+        if (compact)
+            alphaRange16(plane16(3, y) + p0, p1 - p0, rowMin[r], rowMax[r]);
+        else
+            alphaRange(plane(3, y) + p0, p1 - p0, rowMin[r], rowMax[r]);
+    }
+}
+
+/*
+ * Returns a float row in which the kernels can compute row y of channel c:
+ * the row itself, or for compact images temp, which is widened to a full
+ * row.  writeRow() stores what they computed.
+ */
+float* image::rowBuffer(int c, int y, vector<float>& temp)
+{
+    if (!compact)
+        return plane(c, y);
+    if (temp.size() < (size_t)width)
+        temp.resize(width);
+    return temp.data();
+}
+
+SIMD_CLONES
+static void unpackRow(float* __restrict out, const unsigned short* in, int n)
+{
+    for (int x = 0; x < n; x++)
+        out[x] = unpack16(in[x]);
+}
+
+SIMD_CLONES
+static void packRow(unsigned short* __restrict out, const float* in, int n)
+{
+    for (int x = 0; x < n; x++)
+        out[x] = pack16(in[x]);
+}
+
+/*
+ * Like rowBuffer(), but the columns [x0, x1) of the returned row hold the
+ * pixels of row y.  Several ranges of one row can be read into the same
+ * temp.
+ */
+float* image::readRow(int c, int y, int x0, int x1, vector<float>& temp)
+{
+    float* row = rowBuffer(c, y, temp);
+    if (compact && x1 > x0)
+        unpackRow(row + x0, plane16(c, y) + x0, x1 - x0);
+    return row;
+}
+
+/*
+ * Stores the columns [x0, x1) of a row from rowBuffer() or readRow() in row
+ * y of channel c.
+ */
+void image::writeRow(int c, int y, int x0, int x1, const float* row)
+{
+    if (compact && x1 > x0)
+        packRow(plane16(c, y) + x0, row + x0, x1 - x0);
+}
+
+/*
+ * Updates the alpha ranges and hole flags of the given tiles from the
+ * ranges of their rows.
+ */
+void image::summarizeTiles(const vector<char>& tiles)
+{
+    forEachRowBand(context, tilesY, [&](int ty0, int ty1, int)
+    {
+        for (int ty = ty0; ty < ty1; ty++)
+        {
+            for (int tx = 0; tx < tilesX; tx++)
+            {
+                int t = ty * tilesX + tx;
+                if (!tiles[t])
+                    continue;
+                float lo = 1, hi = 0;
+                for (int y = ty * TILE_HEIGHT; y < min(height, (ty + 1) * TILE_HEIGHT); y++)
+                {
+                    lo = min(lo, rowMin[(size_t)y * tilesX + tx]);
+                    hi = max(hi, rowMax[(size_t)y * tilesX + tx]);
+                }
+                alphaMin[t] = lo;
+                alphaMax[t] = hi;
+                holes[t] = (lo != 1.0 || hi != 1.0) && (scope.empty() || scope[t]);
+            }
+        }
+    });
+}
+
+/*
+ * Updates the alpha ranges and hole flags of the given tiles from their
+ * alpha values, for callers that wrote the pixels themselves.
+ */
+void image::findHoles(const vector<char>& tiles)
+{
+    vector<t_span> spans = tileSpans(tiles);
+    forEachRowBand(context, spans.size(), [&](int i0, int i1, int)
+    {
+        for (int i = i0; i < i1; i++)
+            coverRow(spans[i].y, spans[i].x0, spans[i].x1);
+    });
+    summarizeTiles(tiles);
+}
+
+/*
+ * Returns the row segments covered by the given tiles, one per pixel row of
+ * every run of consecutive tiles.
+ */
+vector<t_span> image::tileSpans(const vector<char>& tiles)
+{
+    vector<t_span> spans;
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            if (!tiles[ty * tilesX + tx])
+                continue;
+            int tx1 = tx;
+            while (tx1 < tilesX && tiles[ty * tilesX + tx1])
+                tx1++;
+            for (int y = ty * TILE_HEIGHT; y < min(height, (ty + 1) * TILE_HEIGHT); y++)
+            {
+                t_span s = {y, tx * TILE_WIDTH, min(width, tx1 * TILE_WIDTH)};
+                spans.push_back(s);
+            }
+            tx = tx1;
+        }
+    }
+    return spans;
+}
+
+/*
+ * Returns the first row of the tile row of span i, or a row beyond every
+ * image past the last span.  Spans before i lie in this or earlier tile
+ * rows.
+ */
+static int firstRow(const vector<t_span>& spans, int i)
+{
+    if (i >= (int)spans.size())
+        return INT_MAX / 2;
+    return spans[i].y / TILE_HEIGHT * TILE_HEIGHT;
+}
+
+/*
+ * Calls visit(tx, ty) for the tiles in the rows [q0, q1] that contain one of
+ * the columns [p0, p1), which wrap around horizontally.
+ */
+void image::forEachTileIn(int p0, int p1, int q0, int q1, const function<void(int, int)>& visit)
+{
+    int t0, t1, t2 = 0;
+    if (p1 - p0 >= width)
+    {
+        t0 = 0;
+        t1 = tilesX;
+    }
+    else
+    {
+        int p = (p0 % width + width) % width;
+        t0 = p / TILE_WIDTH;
+        t1 = (min(width, p + p1 - p0) - 1) / TILE_WIDTH + 1;
+        if (p + p1 - p0 > width)
+            t2 = (p + p1 - p0 - width - 1) / TILE_WIDTH + 1;
+    }
+    for (int ty = max(0, q0) / TILE_HEIGHT; ty <= min(height - 1, q1) / TILE_HEIGHT; ty++)
+    {
+        for (int tx = t0; tx < t1; tx++)
+            visit(tx, ty);
+        for (int tx = 0; tx < t2; tx++)
+            visit(tx, ty);
+    }
+}
+
+/*
+ * Returns in lo and hi the range of source column offsets, relative to 2x,
+ * that the rows [y0, y1) of a half size image with height h read.
+ */
+static void footprintColumns(int h, bool flat, int y0, int y1, int& lo, int& hi)
+{
+    lo = 0;
+    hi = 0;
+    for (int y = y0; y < y1; y++)
+    {
+        t_taps t = blurTaps(y, h, flat);
+        lo = min(lo, t.first);
+        hi = max(hi, t.last + 1);
+    }
+}
+
+/*
+ * Calls visit(tx, ty) for the tiles of this image that blurredHalfSize reads
+ * for the columns [x0, x1) and rows [y0, y1) of the half size image, given
+ * the column offsets lo and hi from footprintColumns.
+ */
+void image::forEachFootprintTile(int lo, int hi, int x0, int x1, int y0, int y1, const function<void(int, int)>& visit)
+{
+    int p0 = 2 * x0 + lo;
+    int p1 = 2 * (x1 - 1) + hi;
+    int v0 = 2 * y0 - 3;
+    int v1 = 2 * (y1 - 1) + 4;
+    int q0 = min(v0, 2 * height - v1 - 1);
+    int q1 = max(v1, -1 - v0);
+    forEachTileIn(p0, p1, q0, q1, visit);
+    if (v0 < 0 || v1 >= height)
+        forEachTileIn(width - p1, width - p0, q0, q1, visit);
+}
+
+/*
+ * Computes the given tiles of a half size image from its source image, after
+ * computing whatever the source image still lacks for them.
+ */
+void image::ensureTiles(const vector<char>& tiles)
+{
+    vector<char> missing(tiles.size(), false);
+    bool any = false;
+    for (size_t t = 0; t < tiles.size(); t++)
+    {
+        missing[t] = tiles[t] && !valid[t];
+        any |= missing[t];
+    }
+    if (!any || source == NULL)
+        return;
+    vector<char> needed(source->valid.size(), false);
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        int y0 = ty * TILE_HEIGHT;
+        int y1 = min(height, y0 + TILE_HEIGHT);
+        int lo, hi;
+        footprintColumns(height, flat, y0, y1, lo, hi);
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            if (missing[ty * tilesX + tx])
+                source->forEachFootprintTile(lo, hi, tx * TILE_WIDTH, min(width, (tx + 1) * TILE_WIDTH), y0, y1,
+                                             [&](int sx, int sy) { needed[sy * source->tilesX + sx] = true; });
+        }
+    }
+    source->ensureTiles(needed);
+    source->blurTiles(this, missing);
+    for (size_t t = 0; t < tiles.size(); t++)
+        valid[t] = valid[t] || missing[t];
+    if (corrected)
+        correctAlphaTiles(missing);
+    else
+        summarizeTiles(missing);
+}
+
+/*
+ * Computes the given tiles of result, the half size of this image.
+ */
+void image::blurTiles(image* result, const vector<char>& tiles)
+{
+    blurSpans(result, result->tileSpans(tiles));
+}
+
+/*
+ * Computes the given spans of result, the half size of this image.  With the
+ * plan to of its level only the colours are computed and normalized by its
+ * alpha sums; the alpha values of this image are then taken from its plan
+ * from, or from the image itself without one.
+ */
+void image::blurSpans(image* result, const vector<t_span>& spans, const t_planLevel* from, const t_planLevel* to)
+{
+    int w = result->width;
+    int h = result->height;
+    int channels = to != NULL ? 3 : 4;
+    // compact images, which never follow plans, may be blurred in fixed point
+    bool fixedPoint = compact && context->fixedPoint && from == NULL && to == NULL;
+    // the sums of the plan follow each other span by span
+    vector<size_t> offsets(to != NULL ? spans.size() + 1 : 0, 0);
+    for (size_t i = 1; i < offsets.size(); i++)
+        offsets[i] = offsets[i - 1] + spans[i - 1].x1 - spans[i - 1].x0;
+    forEachRowBand(context, spans.size(), [&](int i0, int i1, int worker)
+    {
+        t_scratch& scratch = pool->scratch(worker);
+        vector<float>* column = scratch.column;
+        vector<float>& row = scratch.row;
+        vector<float>* even = scratch.even;
+        vector<float>* odd = scratch.odd;
+        vector<float>* acc = scratch.acc;
+        t_tapRuns& runs = scratch.taps;
+        float* col[4];
+        unsigned* fixedCol[4];
+        for (int c = 0; c < 4; c++)
+        {
+            column[c].resize(width);
+            acc[c].resize(w);
+            col[c] = column[c].data();
+            if (fixedPoint)
+            {
+                scratch.fixedColumn[c].resize(width);
+                scratch.fixedAcc[c].resize(w);
+            }
+            fixedCol[c] = scratch.fixedColumn[c].data();
+        }
+        for (int i = i0; i < i1; i++)
+        {
+            int y = spans[i].y;
+            int x0 = spans[i].x0;
+            int x1 = spans[i].x1;
+            t_taps t = blurTaps(y, h, flat);
+            tapRuns(t, x0, x1, runs);
+
+            // the source columns [lo, lo + n) that the taps read, which
+            // wrap around to the columns [p0, p1) and [0, p2)
+            int lo = 2 * x0 + t.first;
+            int n = 2 * (x1 - 1) + t.last + 1 - lo;
+            int p0 = 0;
+            int p1 = width;
+            int p2 = 0;
+            if (n < width)
+            {
+                p0 = (lo % width + width) % width;
+                p1 = min(width, p0 + n);
+                p2 = max(0, p0 + n - width);
+            }
+
+            float weights = 0;
+            unsigned fixedWeights = 0;
+            for (int c = 0; c < channels; c++)
+            {
+                if (fixedPoint)
+                {
+                    fill(fixedCol[c] + p0, fixedCol[c] + p1, 0u);
+                    fill(fixedCol[c], fixedCol[c] + p2, 0u);
+                    continue;
+                }
+                fill(col[c] + p0, col[c] + p1, 0.0f);
+                fill(col[c], col[c] + p2, 0.0f);
+            }
+            for (int v = y * 2 - 3; v <= y * 2 + 4; v++)
+            {
+                float dy = ((float)(v - y * 2) - 0.5) / 4;
+                float weighty = 1 + dy*dy*dy*dy - 2*dy*dy;
+                bool mirror;
+                int q = tapRow(v, height, mirror);
+                if (fixedPoint)
+                {
+                    unsigned short* src[4];
+                    for (int c = 0; c < 4; c++)
+                        src[c] = plane16(c, q);
+                    unsigned short weight = fixedWeight(weighty);
+                    blurColumnsFixed(fixedCol, src, width, p0, p1, mirror, weight);
+                    blurColumnsFixed(fixedCol, src, width, 0, p2, mirror, weight);
+                    fixedWeights += weight;
+                    continue;
+                }
+                float* src[4];
+                if (from != NULL)
+                    src[3] = (float*)&from->alpha[(size_t)from->rows[q] * width];
+                else if (to != NULL)
+                    src[3] = plane(3, q);
+                for (int c = 0; c < channels; c++)
+                {
+                    if (mirror)
+                    {
+                        readRow(c, q, width - p1, width - p0, scratch.converted[c]);
+                        src[c] = readRow(c, q, width - p2, width, scratch.converted[c]);
+                    }
+                    else
+                    {
+                        readRow(c, q, p0, p1, scratch.converted[c]);
+                        src[c] = readRow(c, q, 0, p2, scratch.converted[c]);
+                    }
+                }
+                blurColumns(col, src, width, p0, p1, mirror, weighty, channels);
+                blurColumns(col, src, width, 0, p2, mirror, weighty, channels);
+                weights += weighty;
+            }
+            if (fixedPoint)
+            {
+                blurRowFixed(result, y, x0, x1, runs, lo, n, p0, p1, p2, fixedCol, fixedWeights, scratch);
+                continue;
+            }
+
+            row.resize(n);
+            for (int c = 0; c < channels; c++)
+            {
+                wrapRow(row.data(), col[c], width, -lo, n);
+                deinterleave(even[c], odd[c], row.data(), n);
+                fill(acc[c].begin(), acc[c].begin() + (x1 - x0), 0.0f);
+            }
+
+            for (size_t k = 0; k < runs.sums.size(); k++)
+            {
+                int xa = runs.start[k];
+                int xb = runs.start[k + 1];
+                for (int j = runs.first[k]; j < runs.first[k + 1]; j++)
+                {
+                    int i = 2 * xa + runs.offsets[j] - lo;
+                    for (int c = 0; c < channels; c++)
+                        blurTap(acc[c].data() + (xa - x0), (i % 2 ? odd[c].data() : even[c].data()) + i / 2,
+                                xb - xa, runs.weights[j]);
+                }
+            }
+            float* out[4];
+            float* sum[4];
+            for (int c = 0; c < channels; c++)
+            {
+                out[c] = result->rowBuffer(c, y, scratch.converted[4 + c]) + x0;
+                sum[c] = acc[c].data();
+            }
+            if (to != NULL)
+            {
+                blurFinishColours(out, sum, &to->sums[offsets[i]], x1 - x0);
+                for (int c = 0; c < channels; c++)
+                    result->writeRow(c, y, x0, x1, out[c] - x0);
+                continue;
+            }
+            if (result->recording != NULL)
+                copy(sum[3], sum[3] + (x1 - x0), &result->recording->sums[(size_t)y * w + x0]);
+            for (size_t k = 0; k < runs.sums.size(); k++)
+            {
+                int xa = runs.start[k] - x0;
+                float* o[4] = {out[0] + xa, out[1] + xa, out[2] + xa, out[3] + xa};
+                float* s[4] = {sum[0] + xa, sum[1] + xa, sum[2] + xa, sum[3] + xa};
+                blurFinish(o, s, runs.start[k + 1] - runs.start[k], weights * runs.sums[k]);
+            }
+            for (int c = 0; c < 4; c++)
+                result->writeRow(c, y, x0, x1, out[c] - x0);
+            result->coverRow(y, x0, x1);
+        }
+    }, true, evictor([&](int i0, int i1)
+    {
+        // later rows y read the source rows from 2 * y - 3 on
+        int y0 = firstRow(spans, i0);
+        int y1 = firstRow(spans, i1);
+        evictRows(2 * y0 - 3, 2 * y1 - 3);
+        result->evictRows(y0, y1);
+    }));
+}
+
+/*
+ * Finishes row y of result, the half size of this compact image, from the
+ * fixed point columns [p0, p1) and [0, p2) that blurSpans() summed with the
+ * vertical weights fixedWeights.
+ */
+void image::blurRowFixed(image* result, int y, int x0, int x1, const t_tapRuns& runs, int lo, int n, int p0,
+                         int p1, int p2, unsigned** column, unsigned fixedWeights, t_scratch& scratch)
+{
+    vector<unsigned short>& row = scratch.fixedRow;
+    unsigned* acc[4];
+    unsigned short* out[4];
+    // the columns are rounded to 15 bit, relative to the largest alpha sum
+    // of the row so that faint rows keep their precision; the premultiplied
+    // colours never exceed the alpha values
+    unsigned largest = columnMax(column[3], 0, p2, columnMax(column[3], p0, p1, 0));
+    int shift = 0;
+    while ((largest >> shift) >= 32767)
+        shift++;
+    row.resize(width + n);
+    for (int c = 0; c < 4; c++)
+    {
+        // the rounded columns are kept behind the row that wraps them
+        unsigned short* col = row.data() + n;
+        narrowColumn(col, column[c], p0, p1, shift);
+        narrowColumn(col, column[c], 0, p2, shift);
+        wrapRow(row.data(), (const unsigned short*)col, width, -lo, n);
+        deinterleave(scratch.fixedEven[c], scratch.fixedOdd[c], row.data(), n);
+        acc[c] = scratch.fixedAcc[c].data();
+        fill(acc[c], acc[c] + (x1 - x0), 0u);
+        out[c] = result->plane16(c, y) + x0;
+    }
+    // an opaque column would sum to exactly this; rows without one may not
+    // fit their sums into 16 bit
+    unsigned long long opaque = ((unsigned long long)65535 * fixedWeights + ((1u << shift) >> 1)) >> shift;
+    for (size_t k = 0; k < runs.sums.size(); k++)
+    {
+        int xa = runs.start[k] - x0;
+        int count = runs.start[k + 1] - runs.start[k];
+        unsigned weights = 0;
+        for (int j = runs.first[k]; j < runs.first[k + 1]; j++)
+        {
+            unsigned short weightx = fixedWeight(runs.weights[j], FIXED_WEIGHT_BITS - 1);
+            int i = 2 * runs.start[k] + runs.offsets[j] - lo;
+            for (int c = 0; c < 4; c++)
+            {
+                const unsigned short* taps = i % 2 ? scratch.fixedOdd[c].data() : scratch.fixedEven[c].data();
+                blurTapFixed(acc[c] + xa, taps + i / 2, count, weightx);
+            }
+            weights += weightx;
+        }
+        unsigned short* o[4] = {out[0] + xa, out[1] + xa, out[2] + xa, out[3] + xa};
+        unsigned* s[4] = {acc[0] + xa, acc[1] + xa, acc[2] + xa, acc[3] + xa};
+        blurFinishFixed(o, s, count, (float)(65535.0 / (opaque * weights)));
+    }
+    result->coverRow(y, x0, x1);
+}
+
+image* image::blurredHalfSizePlanar()
+{
+    int w = (width + 1) / 2;
+    int h = (height + 1) / 2;
+    size_t channelBytes = compact ? sizeof(unsigned short) : sizeof(float);
+    image* result = new image(context, w, h, (float*)pool->allocate((size_t)w * h * 4 * channelBytes));
+    result->pool = pool;
+    result->pooled = true;
+    result->compact = compact;
+    result->flat = flat;
+    result->initTiles(false);
+    result->source = this;
+    if (recording != NULL)
+        result->record(recording->levels);
+    vector<char> tiles(result->valid.size(), false);
+    forEachRowBand(context, result->tilesY, [&](int ty0, int ty1, int)
+    {
+        for (int ty = ty0; ty < ty1; ty++)
+        {
+            int y0 = ty * TILE_HEIGHT;
+            int y1 = min(h, y0 + TILE_HEIGHT);
+            int lo, hi;
+            footprintColumns(h, flat, y0, y1, lo, hi);
+            for (int tx = 0; tx < result->tilesX; tx++)
+            {
+                bool hole = false;
+                forEachFootprintTile(lo, hi, tx * TILE_WIDTH, min(w, (tx + 1) * TILE_WIDTH), y0, y1,
+                                     [&](int sx, int sy) { hole |= holes[sy * tilesX + sx]; });
+                tiles[ty * result->tilesX + tx] = hole;
+            }
+        }
+    });
+    result->ensureTiles(tiles);
+    return result;
+}
+
+/*
+ * Makes sure that the source pixels for the given tiles of the double size
+ * image target are computed, including a margin of one pixel.
+ */
+void image::ensureUpsampleSource(image* target, const vector<char>& tiles)
+{
+    vector<char> needed(valid.size(), false);
+    for (int ty = 0; ty < target->tilesY; ty++)
+    {
+        for (int tx = 0; tx < target->tilesX; tx++)
+        {
+            if (tiles[ty * target->tilesX + tx])
+                forEachTileIn(tx * TILE_WIDTH / 2 - 1, (tx + 1) * TILE_WIDTH / 2 + 1,
+                              ty * TILE_HEIGHT / 2 - 1, (ty + 1) * TILE_HEIGHT / 2,
+                              [&](int sx, int sy) { needed[sy * tilesX + sx] = true; });
+        }
+    }
+    ensureTiles(needed);
+}
+
+SIMD_CLONES
+static void upsampleRow(float* __restrict out, const float* a, const float* b, int n, int x0, int x1)
+{
+    // a is the source row, b its vertical neighbour; columns wrap around and
+    // out receives the pixels from 2 * x0 on
+    out -= x0 * 2;
+    auto edge = [&](int x)
+    {
+        int xm1 = (x + n - 1) % n;
+        int xp1 = (x + 1) % n;
+        out[x * 2] = (a[x] * 9 + b[x] * 3 + b[xm1] * 1 + a[xm1] * 3) / 16;
+        out[x * 2 + 1] = (a[x] * 9 + b[x] * 3 + b[xp1] * 1 + a[xp1] * 3) / 16;
+    };
+    int i0 = max(x0, 1);
+    int i1 = min(x1, n - 1);
+    if (x0 == 0)
+        edge(0);
+    for (int x = i0; x < i1; x++)
+    {
+        out[x * 2] = (a[x] * 9 + b[x] * 3 + b[x - 1] * 1 + a[x - 1] * 3) / 16;
+        out[x * 2 + 1] = (a[x] * 9 + b[x] * 3 + b[x + 1] * 1 + a[x + 1] * 3) / 16;
+    }
+    if (x1 == n && n > 1)
+        edge(n - 1);
+}
+
+/*
+ * The fixed point counterpart of upsampleRow(), which rounds.
+ */
+SIMD_CLONES
+static void upsampleRowFixed(unsigned short* __restrict out, const unsigned short* a, const unsigned short* b, int n,
+                             int x0, int x1)
+{
+    out -= x0 * 2;
+    auto edge = [&](int x)
+    {
+        int xm1 = (x + n - 1) % n;
+        int xp1 = (x + 1) % n;
+        out[x * 2] = (a[x] * 9 + b[x] * 3 + b[xm1] * 1 + a[xm1] * 3 + 8) >> 4;
+        out[x * 2 + 1] = (a[x] * 9 + b[x] * 3 + b[xp1] * 1 + a[xp1] * 3 + 8) >> 4;
+    };
+    int i0 = max(x0, 1);
+    int i1 = min(x1, n - 1);
+    if (x0 == 0)
+        edge(0);
+    for (int x = i0; x < i1; x++)
+    {
+        out[x * 2] = ((unsigned)a[x] * 9 + b[x] * 3 + b[x - 1] * 1 + a[x - 1] * 3 + 8) >> 4;
+        out[x * 2 + 1] = ((unsigned)a[x] * 9 + b[x] * 3 + b[x + 1] * 1 + a[x + 1] * 3 + 8) >> 4;
+    }
+    if (x1 == n && n > 1)
+        edge(n - 1);
+}
+
+SIMD_CLONES
+static void blendRow(float** dst, float** src, int n)
+{
+    // alpha is truncated to 0 or 1 like in the scalar kernel, so blending
+    // selects either the pixel itself or the interpolated one
+    float* __restrict a = dst[3];
+    for (int c = 0; c < 3; c++)
+    {
+        float* __restrict d = dst[c];
+        float* s = src[c];
+        for (int x = 0; x < n; x++)
+            d[x] = (int)a[x] != 0 ? d[x] : s[x];
+    }
+    for (int x = 0; x < n; x++)
+        a[x] = (int)a[x] != 0 ? a[x] : src[3][x];
+}
+
+/*
+ * The fixed point counterpart of blendRow(), in which only 65535 is opaque.
+ */
+SIMD_CLONES
+static void blendRowFixed(unsigned short** dst, unsigned short** src, int n)
+{
+    // the selection is a mask, which keeps the loops free of branches
+    unsigned short* __restrict a = dst[3];
+    for (int c = 0; c < 3; c++)
+    {
+        unsigned short* __restrict d = dst[c];
+        const unsigned short* s = src[c];
+        for (int x = 0; x < n; x++)
+        {
+            unsigned short keep = -(unsigned short)(a[x] == 65535);
+            d[x] = (d[x] & keep) | (s[x] & ~keep);
+        }
+    }
+    const unsigned short* s = src[3];
+    for (int x = 0; x < n; x++)
+    {
+        unsigned short keep = -(unsigned short)(a[x] == 65535);
+        a[x] = (a[x] & keep) | (s[x] & ~keep);
+    }
+}
+
+/*
+ * With the spans of a plan, their colours are replaced by the interpolated
+ * ones, and the alpha channel is left alone.  Compact images, which never
+ * follow plans, are blended in fixed point if the context asks for it.
+ */
+void image::alphaBlendUpsampledPlanar(image* img, const vector<t_span>* planned)
+{
+    // pixels outside the holes keep their values; the others are blended
+    // in chunks of BLEND_CHUNK pixels, which are interpolated into a small
+    // buffer first
+    vector<char> tiles = holes;
+    int channels = planned != NULL ? 3 : 4;
+    if (planned == NULL)
+        img->ensureUpsampleSource(this, tiles);
+    if (recording != NULL)
+        recording->blended = tiles;
+    vector<t_span> spans = planned != NULL ? *planned : tileSpans(tiles);
+    forEachRowBand(context, spans.size(), [&](int i0, int i1, int worker)
+    {
+        t_scratch& scratch = pool->scratch(worker);
+        vector<float>& buffer = scratch.buffer;
+        buffer.resize(4 * (BLEND_CHUNK + 2));
+        for (int i = i0; i < i1; i++)
+        {
+            int y = spans[i].y / 2;
+            int yn = spans[i].y % 2 ? min(img->height - 1, y + 1) : max(0, y - 1);
+            if (compact && context->fixedPoint)
+            {
+                blendSpanFixed(img, spans[i], y, yn, (unsigned short*)buffer.data());
+                continue;
+            }
+            // the source columns that the interpolation reads, which wrap
+            // around at the borders
+            int n = img->width;
+            int sx0 = spans[i].x0 / 2;
+            int sx1 = (spans[i].x1 + 1) / 2;
+            float* a[4];
+            float* b[4];
+            for (int c = 0; c < channels; c++)
+            {
+                a[c] = img->readRow(c, y, max(0, sx0 - 1), min(n, sx1 + 1), scratch.converted[c]);
+                b[c] = img->readRow(c, yn, max(0, sx0 - 1), min(n, sx1 + 1), scratch.converted[4 + c]);
+                if (sx0 == 0)
+                {
+                    img->readRow(c, y, n - 1, n, scratch.converted[c]);
+                    img->readRow(c, yn, n - 1, n, scratch.converted[4 + c]);
+                }
+                if (sx1 + 1 > n)
+                {
+                    img->readRow(c, y, 0, 1, scratch.converted[c]);
+                    img->readRow(c, yn, 0, 1, scratch.converted[4 + c]);
+                }
+            }
+            for (int x0 = spans[i].x0; x0 < spans[i].x1; x0 += BLEND_CHUNK)
+            {
+                int x1 = min(spans[i].x1, x0 + BLEND_CHUNK);
+                float* dst[4];
+                float* src[4];
+                for (int c = 0; c < channels; c++)
+                {
+                    dst[c] = readRow(c, spans[i].y, x0, x1, scratch.converted[8 + c]) + x0;
+                    src[c] = &buffer[c * (BLEND_CHUNK + 2)];
+                    if (context->interpolator == 1)
+                        upsampleRow(src[c], a[c], b[c], n, x0 / 2, (x1 + 1) / 2);
+                    else
+                    {
+                        for (int x = x0; x < x1; x++)
+                            src[c][x - x0] = a[c][x / 2];
+                    }
+                }
+                if (planned != NULL)
+                {
+                    // the interpolation starts at an even column
+                    int offset = context->interpolator == 1 ? x0 % 2 : 0;
+                    for (int c = 0; c < channels; c++)
+                        copy(src[c] + offset, src[c] + offset + (x1 - x0), dst[c]);
+                    continue;
+                }
+                blendRow(dst, src, x1 - x0);
+                for (int c = 0; c < 4; c++)
+                    writeRow(c, spans[i].y, x0, x1, dst[c] - x0);
+                coverRow(spans[i].y, x0, x1);
+            }
+        }
+    }, false, evictor([&](int i0, int i1)
+    {
+        // later rows y read the source rows from y / 2 - 1 on
+        int y0 = firstRow(spans, i0);
+        int y1 = firstRow(spans, i1);
+        evictRows(y0, y1);
+        img->evictRows(y0 / 2 - 1, y1 / 2 - 1);
+    }));
+    if (planned == NULL)
+        summarizeTiles(tiles);
+}
+
+/*
+ * Blends the pixels of span, a row of this compact image, with the rows y and
+ * yn of img, which it interpolates into buffer, chunk by chunk.
+ */
+void image::blendSpanFixed(image* img, const t_span& span, int y, int yn, unsigned short* buffer)
+{
+    int n = img->width;
+    for (int x0 = span.x0; x0 < span.x1; x0 += BLEND_CHUNK)
+    {
+        int x1 = min(span.x1, x0 + BLEND_CHUNK);
+        unsigned short* dst[4];
+        unsigned short* src[4];
+        for (int c = 0; c < 4; c++)
+        {
+            const unsigned short* a = img->plane16(c, y);
+            dst[c] = plane16(c, span.y) + x0;
+            src[c] = buffer + c * (BLEND_CHUNK + 2);
+            if (context->interpolator == 1)
+                upsampleRowFixed(src[c], a, img->plane16(c, yn), n, x0 / 2, (x1 + 1) / 2);
+            else
+            {
+                for (int x = x0; x < x1; x++)
+                    src[c][x - x0] = a[x / 2];
+            }
+        }
+        blendRowFixed(dst, src, x1 - x0);
+        coverRow(span.y, x0, x1);
+    }
+}
+
+SIMD_CLONES
+static void correctAlphaRow(float* a, int n)
+{
+    for (int x = 0; x < n; x++)
+        a[x] = min(1.0f, a[x] * 5);
+}
+
+SIMD_CLONES
+static void correctAlphaRowFixed(unsigned short* a, int n)
+{
+    for (int x = 0; x < n; x++)
+    {
+        int v = a[x] * 5;
+        a[x] = v < 65535 ? v : 65535;
+    }
+}
+
+void image::correctAlphaTiles(const vector<char>& tiles)
+{
+    vector<t_span> spans = tileSpans(tiles);
+    forEachRowBand(context, spans.size(), [&](int i0, int i1, int worker)
+    {
+        vector<float>& temp = pool->scratch(worker).converted[0];
+        for (int i = i0; i < i1; i++)
+        {
+            if (compact && context->fixedPoint)
+            {
+                correctAlphaRowFixed(plane16(3, spans[i].y) + spans[i].x0, spans[i].x1 - spans[i].x0);
+                coverRow(spans[i].y, spans[i].x0, spans[i].x1);
+                continue;
+            }
+            float* a = readRow(3, spans[i].y, spans[i].x0, spans[i].x1, temp);
+            correctAlphaRow(a + spans[i].x0, spans[i].x1 - spans[i].x0);
+            if (recording != NULL)
+                copy(a + spans[i].x0, a + spans[i].x1, &recording->alpha[(size_t)spans[i].y * width + spans[i].x0]);
+            writeRow(3, spans[i].y, spans[i].x0, spans[i].x1, a);
+            coverRow(spans[i].y, spans[i].x0, spans[i].x1);
+        }
+    }, false, evictor([&](int i0, int i1) { evictRows(firstRow(spans, i0), firstRow(spans, i1)); }));
+    summarizeTiles(tiles);
+}
+
+void image::correctAlphaPlanar()
+{
+    corrected = true;
+    correctAlphaTiles(valid);
+}
+
+/*
+ * Starts recording what the fill of this level does for a plan into a new
+ * record at the end of levels.  The levels below add their records after it;
+ * a deque keeps the earlier records in place while it grows.
+ */
+void image::record(deque<t_levelRecord>* levels)
+{
+    levels->push_back(t_levelRecord());
+    t_levelRecord* level = &levels->back();
+    level->levels = levels;
+    recording = level;
+    level->width = width;
+    level->height = height;
+    level->blended.assign(valid.size(), false);
+    if (source != NULL)
+    {
+        level->alpha.assign((size_t)width * height, 0.0f);
+        level->sums.assign((size_t)width * height, 0.0f);
+    }
+}
+
+/*
+ * Returns a checksum of the alpha channel of a planar image and of the
+ * settings that change how it is filled, so that plans saved with other
+ * settings do not match.
+ */
+unsigned long long image::alphaChecksum()
+{
+    vector<unsigned long long> rows(height);
+    forEachRowBand(context, height, [&](int y0, int y1, int)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            // four independent lanes of FNV-1a over the bits of the values
+            const float* a = plane(3, y);
+            unsigned long long h[4] = {0xcbf29ce484222325ULL, 1, 2, 3};
+            for (int x = 0; x < width; x++)
+            {
+                unsigned int bits;
+                memcpy(&bits, a + x, sizeof(bits));
+                h[x % 4] = (h[x % 4] ^ bits) * 0x100000001b3ULL;
+            }
+            unsigned long long r = 0;
+            for (int k = 0; k < 4; k++)
+                r = (r ^ h[k] ^ (h[k] >> 29)) * 0x100000001b3ULL;
+            rows[y] = r;
+        }
+    });
+    unsigned long long r = (0xcbf29ce484222325ULL ^ context->interpolator ^ context->storageBits << 8) * 0x100000001b3ULL;
+    for (int y = 0; y < height; y++)
+        r = (r ^ rows[y] ^ (rows[y] >> 31)) * 0x100000001b3ULL;
+    return r;
+}
+
+/*
+ * Returns true if plan fills this image, which must then be planar with
+ * floats and have the size and alpha channel that plan was compiled for.
+ */
+bool image::matches(const t_maskPlan& plan)
+{
+    if (planes == NULL || compact || plan.levels.empty() || width != plan.width || height != plan.height)
+        return false;
+    return alphaChecksum() == plan.checksum;
+}
+
+/*
+ * Appends pixel x of row y to spans, which are ordered by rows and columns.
+ * A pixel that is at most gap pixels away from the last span extends it.
+ */
+static void addPixel(vector<t_span>& spans, int y, int x, int gap = 0)
+{
+    if (!spans.empty() && spans.back().y == y && x - spans.back().x1 <= gap)
+        spans.back().x1 = x + 1;
+    else
+    {
+        t_span s = {y, x, x + 1};
+        spans.push_back(s);
+    }
+}
+
+/*
+ * Compiles the records of a fill of this image into plan.  holes are the
+ * pixels of this level that the fill interpolated.  Going down the levels,
+ * the pixels that the interpolation into the needed pixels of the level
+ * above reads are needed, and they are either interpolated themselves or
+ * keep their computed colours.  Going up again, the computed pixels of a
+ * level need the pixels with alpha of the level above that their filter
+ * reads.  Computed pixels close to each other are joined into one span, as
+ * the filter near the poles reads whole rows for every span.
+ */
+void image::compilePlan(t_maskPlan* plan, deque<t_levelRecord>& records, const vector<t_span>& holes)
+{
+    int n = records.size();
+    plan->levels.assign(n, t_planLevel());
+    for (int k = 0; k < n; k++)
+    {
+        plan->levels[k].width = records[k].width;
+        plan->levels[k].height = records[k].height;
+    }
+    plan->levels[0].blended = holes;
+    vector<vector<char> > kept(n);
+    for (int k = 0; k + 1 < n; k++)
+    {
+        const t_levelRecord& next = records[k + 1];
+        int w = next.width;
+        int h = next.height;
+        int tilesX = (w + TILE_WIDTH - 1) / TILE_WIDTH;
+        vector<char> read((size_t)w * h, false);
+        const vector<t_span>& blended = plan->levels[k].blended;
+        for (size_t i = 0; i < blended.size(); i++)
+        {
+            int y = blended[i].y / 2;
+            int yn = blended[i].y % 2 ? min(h - 1, y + 1) : max(0, y - 1);
+            for (int x = blended[i].x0 / 2 - 1; x <= (blended[i].x1 - 1) / 2 + 1; x++)
+            {
+                int p = (x + w) % w;
+                read[(size_t)y * w + p] = true;
+                read[(size_t)yn * w + p] = true;
+            }
+        }
+        kept[k + 1].assign(read.size(), false);
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                size_t p = (size_t)y * w + x;
+                if (!read[p])
+                    continue;
+                if (next.blended[y / TILE_HEIGHT * tilesX + x / TILE_WIDTH] && (int)next.alpha[p] == 0)
+                    addPixel(plan->levels[k + 1].blended, y, x);
+                else
+                    kept[k + 1][p] = true;
+            }
+        }
+    }
+    for (int k = n - 1; k >= 1; k--)
+    {
+        const t_levelRecord& level = records[k];
+        int w = level.width;
+        int h = level.height;
+        t_planLevel& planned = plan->levels[k];
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                if (kept[k][(size_t)y * w + x])
+                    addPixel(planned.computed, y, x, TILE_WIDTH);
+            }
+        }
+        for (size_t i = 0; i < planned.computed.size(); i++)
+        {
+            const float* sums = &level.sums[(size_t)planned.computed[i].y * w];
+            planned.sums.insert(planned.sums.end(), sums + planned.computed[i].x0, sums + planned.computed[i].x1);
+        }
+        if (k == 1)
+            break;
+        // the finest level reads its alpha channel from the image itself
+        const t_levelRecord& above = records[k - 1];
+        int width = above.width;
+        vector<char> rows(above.height, false);
+        for (size_t i = 0; i < planned.computed.size(); i++)
+        {
+            const t_span& s = planned.computed[i];
+            t_taps t = blurTaps(s.y, h, flat);
+            int lo = 2 * s.x0 + t.first;
+            int count = min(width, 2 * (s.x1 - 1) + t.last + 1 - lo);
+            for (int v = s.y * 2 - 3; v <= s.y * 2 + 4; v++)
+            {
+                bool mirror;
+                int q = tapRow(v, above.height, mirror);
+                rows[q] = true;
+                for (int j = 0; j < count; j++)
+                {
+                    int p = ((lo + j) % width + width) % width;
+                    if (mirror)
+                        p = width - p - 1;
+                    if (above.alpha[(size_t)q * width + p] != 0)
+                        kept[k - 1][(size_t)q * width + p] = true;
+                }
+            }
+        }
+        t_planLevel& source = plan->levels[k - 1];
+        source.rows.assign(above.height, -1);
+        for (int q = 0; q < above.height; q++)
+        {
+            if (!rows[q])
+                continue;
+            source.rows[q] = source.alpha.size() / width;
+            source.alpha.insert(source.alpha.end(), &above.alpha[(size_t)q * width],
+                                &above.alpha[(size_t)(q + 1) * width]);
+        }
+    }
+    while (n > 1 && plan->levels[n - 1].computed.empty() && plan->levels[n - 1].blended.empty())
+        n--;
+    plan->levels.resize(n);
+    plan->result.clear();
+    for (size_t i = 0; i < holes.size(); i++)
+    {
+        const float* a = plane(3, holes[i].y);
+        plan->result.insert(plan->result.end(), a + holes[i].x0, a + holes[i].x1);
+    }
+}
+
+/*
+ * Fills this image as usual and compiles what the fill did into plan.
+ * Returns false if the fill fails.
+ */
+bool image::recordPlan(t_maskPlan* plan, t_stats* stats)
+{
+    vector<t_span> spans = tileSpans(holes);
+    vector<t_span> interpolated;
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        const float* a = plane(3, spans[i].y);
+        for (int x = spans[i].x0; x < spans[i].x1; x++)
+        {
+            if ((int)a[x] == 0)
+                addPixel(interpolated, spans[i].y, x);
+        }
+    }
+    plan->width = width;
+    plan->height = height;
+    plan->checksum = alphaChecksum();
+    deque<t_levelRecord> records;
+    record(&records);
+    bool ok = complete(this, stats);
+    recording = NULL;
+    plan->levels.clear();
+    if (!ok)
+        return false;
+    compilePlan(plan, records, interpolated);
+    for (size_t k = 0; k < plan->levels.size(); k++)
+        plan->levels[k].transparent = stats && k < stats->levels.size() ? stats->levels[k].transparent : 0;
+    return true;
+}
+
+/*
+ * Fills this image, which plan matches, by computing the colours of the
+ * pixels that plan computes and interpolates.  Only the interpolated pixels
+ * change their alpha values, which plan holds as well.
+ */
+void image::followPlan(const t_maskPlan& plan, t_stats* stats)
+{
+    if (context->verbosity > 0)
+        clog << gettext("Filling with the plan of a frame with the same alpha channel\n");
+    vector<image*> levels(1, this);
+    for (size_t k = 0; k < plan.levels.size(); k++)
+    {
+        const t_planLevel& l = plan.levels[k];
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        if (k > 0)
+        {
+            image* level = new image(context, l.width, l.height,
+                                     (float*)pool->allocate((size_t)l.width * l.height * 4 * sizeof(float)));
+            level->pool = pool;
+            level->pooled = true;
+            level->flat = flat;
+            levels[k - 1]->blurSpans(level, l.computed, k > 1 ? &plan.levels[k - 1] : NULL, &l);
+            levels.push_back(level);
+        }
+        if (stats)
+        {
+            t_levelStats level = {l.width, l.height, l.transparent, (size_t)l.width * l.height * sizeof(t_fpixel),
+                                  k > 0 ? secondsSince(t0) : 0, 0, 0};
+            stats->levels.push_back(level);
+        }
+    }
+    for (int k = (int)levels.size() - 2; k >= 0; k--)
+    {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        levels[k]->alphaBlendUpsampledPlanar(levels[k + 1], &plan.levels[k].blended);
+        if (stats)
+            stats->levels[k].blend = secondsSince(t0);
+        delete levels[k + 1];
+    }
+    const vector<t_span>& spans = plan.levels[0].blended;
+    vector<char> tiles(valid.size(), false);
+    size_t p = 0;
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        copy(&plan.result[p], &plan.result[p] + (spans[i].x1 - spans[i].x0), plane(3, spans[i].y) + spans[i].x0);
+        p += spans[i].x1 - spans[i].x0;
+        for (int tx = spans[i].x0 / TILE_WIDTH; tx * TILE_WIDTH < spans[i].x1; tx++)
+            tiles[spans[i].y / TILE_HEIGHT * tilesX + tx] = true;
+    }
+    findHoles(tiles);
+}
+
+//------------------------------
+
+/*
+ * Returns the seconds since t0.
+ */
+double secondsSince(chrono::steady_clock::time_point t0)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+/*
+ * What saveLevel() needs of a filled level: the level itself and the image
+ * of the pyramid, whose sample format it is saved with.
+ */
+struct t_levelHandle
+{
+    image* level;
+    image* top;
+};
+
+/*
+ * Fills level n of the pyramid of top, see complete(), and recurses into
+ * the coarser levels.
+ */
+static bool completeLevel(image* img, image* top, t_stats* stats, const t_levelFilled& filled, int n)
+{
+    bool limited = img->context->region.limited() && !img->flat;
+    vector<t_keptPixel> outside;
+    if (n == 0 && limited)
+        outside = img->limitToRegion(img->context->region);
+    if (n == 0 && img->context->poleCaps && !img->flat && img->fillPoleCaps(stats))
+    {
+        img->restorePixels(outside);
+        return true;
+    }
+    if (img->context->verbosity > 0)
+        clog << format(gettext("Enter recursion depth %1% (%2% × %3% pixels)\n")) % n % img->width % img->height;
+    if (stats)
+    {
+        t_levelStats level = {img->width, img->height, img->transparentPixels(),
+                              (size_t)img->width * img->height * (img->compact ? 8 : sizeof(t_fpixel)), 0, 0, 0};
+        stats->levels.push_back(level);
+    }
+    bool ok = true;
+    if (img->noTransparentPixels())
+    {
+        if (img->context->verbosity > 0)
+            clog << format(gettext("No transparent pixels in depth %1%\n")) % n;
+    }
+    else
+    {
+        if (img->context->verbosity > 1)
+        {
+            vector<t_span> spans = img->holeSpans();
+            if (!spans.empty())
+                clog << format(gettext("Transparent pixels in rows %1% to %2%\n")) % spans.front().y % spans.back().y;
+        }
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        image* lowRes = img->blurredHalfSize();
+        double downsample = stats ? secondsSince(t0) : 0;
+        t0 = chrono::steady_clock::now();
+        lowRes->correctAlpha();
+        if (limited)
+            lowRes->limitHoles(img);
+        double correctAlpha = stats ? secondsSince(t0) : 0;
+        ok = completeLevel(lowRes, top, stats, filled, n + 1);
+        if (stats)
+        {
+            stats->levels[n + 1].downsample = downsample;
+            stats->levels[n + 1].correctAlpha = correctAlpha;
+        }
+        if (ok)
+        {
+            t0 = chrono::steady_clock::now();
+            img->alphaBlendUpsampled(lowRes);
+            if (stats)
+                stats->levels[n].blend = secondsSince(t0);
+        }
+        delete lowRes;
+    }
+    img->restorePixels(outside);
+    if (ok && filled)
+    {
+        t_levelHandle handle = {img, top};
+        t_filledLevel level = {n, img->width, img->height, &handle};
+        ok = filled(level);
+    }
+    if (img->context->verbosity > 0)
+        clog << format(gettext("Leave recursion depth %1%\n")) % n;
+    return ok;
+}
+
+/*
+ * Fills the transparent pixels of img.  If stats is given, the timings and
+ * memory use of every level are added to it.  filled, if given, sees every
+ * level once it is filled and may stop the fill there; complete() then
+ * returns false and img is only partly filled.  If the context limits the
+ * fill to a region, the holes outside it keep their pixels and the levels
+ * only fill the holes that the finer levels read.
+ */
+bool complete(image* img, t_stats* stats, const t_levelFilled& filled)
+{
+    return completeLevel(img, img, stats, filled, 0);
+}
+
+/*
+ * Fills img, a frame of a sequence whose frames mostly share their alpha
+ * channel, like the frames of a 360° video with a fixed tripod mask.  A
+ * frame whose alpha channel differs from that of plan is filled as usual
+ * and plan is compiled from its fill, see image::recordPlan().  The
+ * following frames with the same alpha channel follow plan and only compute
+ * the colours of the pixels that the holes depend on, with the same result.
+ * Images that the scalar kernels fill or with compact storage, and fills in
+ * the pole caps or limited to a region, never use plan.
+ */
+bool completeSequence(image* img, t_maskPlan* plan, t_stats* stats)
+{
+    if (img->planes == NULL || img->compact || img->context->poleCaps || img->context->region.limited())
+        return complete(img, stats);
+    if (img->matches(*plan))
+    {
+        img->followPlan(*plan, stats);
+        return true;
+    }
+    return img->recordPlan(plan, stats);
+}
+
+t_maskPlan::t_maskPlan()
+{
+    width = 0;
+    height = 0;
+    checksum = 0;
+}
+
+/*
+ * The values of a plan file are little-endian, whatever the byte order of
+ * the machine, so that plans move between machines.  Every value takes
+ * sizeof() of its type in memory, a t_span its three ints; see putLittle().
+ */
+static unsigned long long getLittle(const char*& p, int n)
+{
+    unsigned long long value = 0;
+    for (int i = 0; i < n; i++)
+        value |= (unsigned long long)(unsigned char)*p++ << 8 * i;
+    return value;
+}
+
+static void putValue(vector<char>& bytes, int value)
+{
+    putLittle(bytes, (unsigned)value, sizeof(value));
+}
+
+static void putValue(vector<char>& bytes, long long value)
+{
+    putLittle(bytes, value, sizeof(value));
+}
+
+static void putValue(vector<char>& bytes, unsigned long long value)
+{
+    putLittle(bytes, value, sizeof(value));
+}
+
+static void putValue(vector<char>& bytes, float value)
+{
+    unsigned bits;
+    memcpy(&bits, &value, sizeof(bits));
+    putLittle(bytes, bits, sizeof(bits));
+}
+
+static void putValue(vector<char>& bytes, const t_span& span)
+{
+    putValue(bytes, span.y);
+    putValue(bytes, span.x0);
+    putValue(bytes, span.x1);
+}
+
+static void getValue(const char*& p, int& value)
+{
+    value = (int)(unsigned)getLittle(p, sizeof(value));
+}
+
+static void getValue(const char*& p, long long& value)
+{
+    value = getLittle(p, sizeof(value));
+}
+
+static void getValue(const char*& p, unsigned long long& value)
+{
+    value = getLittle(p, sizeof(value));
+}
+
+static void getValue(const char*& p, float& value)
+{
+    unsigned bits = getLittle(p, sizeof(bits));
+    memcpy(&value, &bits, sizeof(value));
+}
+
+static void getValue(const char*& p, t_span& span)
+{
+    getValue(p, span.y);
+    getValue(p, span.x0);
+    getValue(p, span.x1);
+}
+
+template <class T>
+static void putVector(vector<char>& bytes, const vector<T>& v)
+{
+    putValue(bytes, (unsigned long long)v.size());
+    for (size_t i = 0; i < v.size(); i++)
+        putValue(bytes, v[i]);
+}
+
+/*
+ * Reads a value of type T from in.  Returns false at the end of the file.
+ */
+template <class T>
+static bool readValue(istream& in, T& value)
+{
+    char bytes[sizeof(T)];
+    const char* p = bytes;
+    if (!in.read(bytes, sizeof(bytes)))
+        return false;
+    getValue(p, value);
+    return true;
+}
+
+template <class T>
+static bool readVector(istream& in, vector<T>& v, unsigned long long limit)
+{
+    unsigned long long n;
+    if (!readValue(in, n) || n > limit)
+        return false;
+    vector<char> bytes(n * sizeof(T));
+    if (!in.read(bytes.data(), bytes.size()))
+        return false;
+    const char* p = bytes.data();
+    v.resize(n);
+    for (size_t i = 0; i < n; i++)
+        getValue(p, v[i]);
+    return true;
+}
+
+/*
+ * Writes plan to the file name.  Returns false if that fails or plan is
+ * empty.
+ */
+bool savePlan(const t_maskPlan& plan, const char* name)
+{
+    if (plan.levels.empty())
+        return false;
+    vector<char> bytes(PLAN_MAGIC, PLAN_MAGIC + sizeof(PLAN_MAGIC) - 1);
+    int levels = plan.levels.size();
+    putValue(bytes, plan.width);
+    putValue(bytes, plan.height);
+    putValue(bytes, plan.checksum);
+    putValue(bytes, levels);
+    for (int k = 0; k < levels; k++)
+    {
+        const t_planLevel& l = plan.levels[k];
+        putValue(bytes, l.transparent);
+        putVector(bytes, l.computed);
+        putVector(bytes, l.sums);
+        putVector(bytes, l.blended);
+        putVector(bytes, l.rows);
+        putVector(bytes, l.alpha);
+    }
+    putVector(bytes, plan.result);
+    ofstream out(name, ios::binary);
+    out.write(bytes.data(), bytes.size());
+    out.close();
+    return !out.fail();
+}
+
+/*
+ * Returns the number of pixels in spans if they lie in an image of the
+ * given size, and -1 otherwise.
+ */
+static long long spanPixels(const vector<t_span>& spans, int width, int height)
+{
+    long long n = 0;
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        const t_span& s = spans[i];
+        if (s.y < 0 || s.y >= height || s.x0 < 0 || s.x0 >= s.x1 || s.x1 > width)
+            return -1;
+        n += s.x1 - s.x0;
+    }
+    return n;
+}
+
+/*
+ * Returns true if following plan stays within the levels it describes.
+ */
+static bool validPlan(const t_maskPlan& plan)
+{
+    int n = plan.levels.size();
+    if (n == 0 || plan.width <= 0 || plan.height <= 0 || !plan.levels[n - 1].blended.empty())
+        return false;
+    for (int k = 0; k < n; k++)
+    {
+        const t_planLevel& l = plan.levels[k];
+        int w = k == 0 ? plan.width : (plan.levels[k - 1].width + 1) / 2;
+        int h = k == 0 ? plan.height : (plan.levels[k - 1].height + 1) / 2;
+        if (l.width != w || l.height != h)
+            return false;
+        long long computed = spanPixels(l.computed, w, h);
+        if (computed < 0 || (k == 0 && computed > 0) || computed != (long long)l.sums.size()
+            || spanPixels(l.blended, w, h) < 0)
+            return false;
+        if (l.alpha.size() % w != 0 || (!l.rows.empty() && (int)l.rows.size() != h))
+            return false;
+        for (size_t q = 0; q < l.rows.size(); q++)
+        {
+            if (l.rows[q] < -1 || l.rows[q] >= (long long)(l.alpha.size() / w))
+                return false;
+        }
+        if (k < 2)
+            continue;
+        // the computed spans read rows of the level above, which must be there
+        const t_planLevel& above = plan.levels[k - 1];
+        for (size_t i = 0; i < l.computed.size(); i++)
+        {
+            for (int v = l.computed[i].y * 2 - 3; v <= l.computed[i].y * 2 + 4; v++)
+            {
+                bool mirror;
+                int q = tapRow(v, above.height, mirror);
+                if (above.rows.empty() || above.rows[q] < 0)
+                    return false;
+            }
+        }
+    }
+    return spanPixels(plan.levels[0].blended, plan.width, plan.height) == (long long)plan.result.size();
+}
+
+/*
+ * Reads the mask of region from the image file name.  Pixels whose grey
+ * value is at least half of the full scale are inside.  Returns false if
+ * the file cannot be read.
+ */
+bool loadRegionMask(t_region* region, const char* name)
+{
+    TIFF* tif = TIFFOpen(name, "r");
+    if (tif == NULL)
+        return false;
+    uint32 w, h;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+    vector<uint32> raster((size_t)w * h);
+    bool ok = w > 0 && h > 0 && TIFFReadRGBAImageOriented(tif, w, h, raster.data(), ORIENTATION_TOPLEFT, 0) != 0;
+    TIFFClose(tif);
+    if (!ok)
+        return false;
+    region->maskWidth = w;
+    region->maskHeight = h;
+    region->mask.resize(raster.size());
+    for (size_t i = 0; i < raster.size(); i++)
+    {
+        uint32 p = raster[i];
+        region->mask[i] = (p & 0xff) + (p >> 8 & 0xff) + (p >> 16 & 0xff) >= 3 * 128;
+    }
+    return true;
+}
+
+/*
+ * Reads a plan that savePlan() wrote.  Returns false if the file cannot be read or holds no valid plan.
+ */
+bool loadPlan(t_maskPlan* plan, const char* name)
+{
+    ifstream in(name, ios::binary);
+    char magic[sizeof(PLAN_MAGIC) - 1];
+    int levels;
+    if (!in.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), PLAN_MAGIC)
+        || !readValue(in, plan->width) || !readValue(in, plan->height) || !readValue(in, plan->checksum)
+        || !readValue(in, levels)
+        || levels < 1 || levels > 64 || plan->width <= 0 || plan->height <= 0)
+        return false;
+    plan->levels.assign(levels, t_planLevel());
+    int w = plan->width;
+    int h = plan->height;
+    for (int k = 0; k < levels; k++)
+    {
+        t_planLevel& l = plan->levels[k];
+        l.width = w;
+        l.height = h;
+        unsigned long long pixels = (unsigned long long)w * h;
+        if (!readValue(in, l.transparent) || !readVector(in, l.computed, pixels)
+            || !readVector(in, l.sums, pixels) || !readVector(in, l.blended, pixels)
+            || !readVector(in, l.rows, h) || !readVector(in, l.alpha, pixels))
+            return false;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+    if (!readVector(in, plan->result, (unsigned long long)plan->width * plan->height) || !validPlan(*plan))
+    {
+        plan->levels.clear();
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Fills the holes of a panorama if all of them lie within a third of its
+ * height from the poles, as a tripod at the nadir or a missing zenith do.
+ * Every cap around a pole that contains holes is reprojected
+ * stereographically into a square flat image, which is filled with the
+ * usual pyramid, and the holes are sampled from it.  The work depends on
+ * the size of the caps instead of the panorama, and the filter never needs
+ * the wide footprints of the rows near the poles.  Returns false without
+ * changing anything if there are no holes or some lie elsewhere.
+ */
+bool image::fillPoleCaps(t_stats* stats)
+{
+    vector<t_span> spans = holeSpans();
+    int limit = height / 3;
+    int zenith = 0;
+    int nadir = 0;
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        if (spans[i].y < limit)
+            zenith = max(zenith, spans[i].y + 1);
+        else if (spans[i].y >= height - limit)
+            nadir = max(nadir, height - spans[i].y);
+        else
+            return false;
+    }
+    if (zenith == 0 && nadir == 0)
+        return false;
+    if (zenith > 0)
+        fillCap(false, zenith, stats);
+    if (nadir > 0)
+        fillCap(true, nadir, stats);
+    if (planes != NULL)
+        summarizeTiles(valid);
+    return true;
+}
+
+/*
+ * Computes the tiles of a level that the fill left out because no hole
+ * depends on them, so that the whole level can be saved.  They are opaque,
+ * so computing them after the fill gives the same pixels as before it.
+ */
+void image::ensureAllTiles()
+{
+    if (planes != NULL)
+        ensureTiles(vector<char>(valid.size(), true));
+}
+
+/*
+ * Limits the fill to the holes in region.  Planar images only treat the
+ * tiles with holes in the region as holes from now on, see limitHoles() for
+ * the smaller levels.  Returns the pixels outside the region that the
+ * fill would change, for restorePixels().
+ */
+vector<t_keptPixel> image::limitToRegion(const t_region& region)
+{
+    vector<t_span> spans = region.spans(width, height);
+    if (planes != NULL)
+    {
+        vector<float> temp;
+        scope.assign(valid.size(), false);
+        for (size_t i = 0; i < spans.size(); i++)
+            markHoleTiles(scope, height - 1 - spans[i].y, spans[i].x0, spans[i].x1, temp);
+        for (size_t t = 0; t < holes.size(); t++)
+            holes[t] = holes[t] && scope[t];
+    }
+    vector<t_keptPixel> kept;
+    vector<char> inside(width);
+    size_t i = 0;
+    for (int r = 0; r < height; r++)
+    {
+        // the spans count rows from the top
+        int y = height - 1 - r;
+        fill(inside.begin(), inside.end(), false);
+        for (; i < spans.size() && spans[i].y == r; i++)
+            fill(inside.begin() + spans[i].x0, inside.begin() + spans[i].x1, true);
+        auto keep = [&](int x0, int x1)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                t_fpixel p = pixel(x, y);
+                if (!inside[x] && p.a != 1.0)
+                {
+                    t_keptPixel k = {x, y, p};
+                    kept.push_back(k);
+                }
+            }
+        };
+        if (planes == NULL)
+            keep(0, width);
+        for (int tx = 0; planes != NULL && tx < tilesX; tx++)
+        {
+            if (holes[y / TILE_HEIGHT * tilesX + tx])
+                keep(tx * TILE_WIDTH, min(width, (tx + 1) * TILE_WIDTH));
+        }
+    }
+    return kept;
+}
+
+/*
+ * Marks the computed tiles that hold a pixel that is not opaque among the
+ * pixels [x0, x1) of row y.
+ */
+void image::markHoleTiles(vector<char>& tiles, int y, int x0, int x1, vector<float>& temp)
+{
+    for (int tx = x0 / TILE_WIDTH; tx * TILE_WIDTH < x1; tx++)
+    {
+        int t = y / TILE_HEIGHT * tilesX + tx;
+        size_t r = (size_t)y * tilesX + tx;
+        if (tiles[t] || !valid[t] || (rowMin[r] == 1.0 && rowMax[r] == 1.0))
+            continue;
+        int p0 = max(x0, tx * TILE_WIDTH);
+        int p1 = min(x1, (tx + 1) * TILE_WIDTH);
+        const float* a = readRow(3, y, p0, p1, temp);
+        for (int x = p0; x < p1 && !tiles[t]; x++)
+            tiles[t] = a[x] != 1.0;
+    }
+}
+
+/*
+ * Limits the holes of this half size image to the tiles with holes that the
+ * blend of the holes of target reads, pixel by pixel.  The holes elsewhere
+ * belong to the part that a limited fill leaves alone and would only deepen
+ * the recursion.
+ */
+void image::limitHoles(image* target)
+{
+    if (planes == NULL)
+        return;
+    scope.assign(valid.size(), false);
+    vector<t_span> spans = target->tileSpans(target->holes);
+    vector<float> temp;
+    vector<float> sourceTemp;
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        const t_span& s = spans[i];
+        const float* a = target->readRow(3, s.y, s.x0, s.x1, temp);
+        for (int x0 = s.x0; x0 < s.x1; x0++)
+        {
+            // the blend changes the runs of pixels that are not opaque and
+            // reads the columns from x / 2 - 1 to x / 2 + 1 of the rows from
+            // y / 2 - 1 to y / 2 + 1 for them
+            if (a[x0] >= 1.0)
+                continue;
+            int x1 = x0 + 1;
+            while (x1 < s.x1 && a[x1] < 1.0)
+                x1++;
+            int c0 = x0 / 2 - 1;
+            int c1 = (x1 - 1) / 2 + 2;
+            for (int q = max(0, s.y / 2 - 1); q <= min(height - 1, s.y / 2 + 1); q++)
+            {
+                if (c1 - c0 >= width)
+                    markHoleTiles(scope, q, 0, width, sourceTemp);
+                else
+                {
+                    int p = (c0 + width) % width;
+                    markHoleTiles(scope, q, p, min(width, p + c1 - c0), sourceTemp);
+                    if (p + c1 - c0 > width)
+                        markHoleTiles(scope, q, 0, p + c1 - c0 - width, sourceTemp);
+                }
+            }
+            x0 = x1;
+        }
+    }
+    for (size_t t = 0; t < holes.size(); t++)
+        holes[t] = holes[t] && scope[t];
+}
+
+/*
+ * Writes back the pixels that limitToRegion() kept.
+ */
+void image::restorePixels(const vector<t_keptPixel>& pixels)
+{
+    if (pixels.empty())
+        return;
+    vector<char> tiles(valid.size(), false);
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+        setPixel(pixels[i].x, pixels[i].y, pixels[i].p);
+        if (planes != NULL)
+            tiles[pixels[i].y / TILE_HEIGHT * tilesX + pixels[i].x / TILE_WIDTH] = true;
+    }
+    if (planes != NULL)
+        findHoles(tiles);
+}
+
+/*
+ * Fills the holes in the given number of rows at the top of the file, or
+ * with nadir at its bottom.  The patch has the resolution of the rows at
+ * the pole and reaches half as far again beyond the holes as they do, so
+ * that the pyramid sees enough of their surroundings.
+ */
+void image::fillCap(bool nadir, int rows, t_stats* stats)
+{
+    double step = PI / height;
+    double cap = min(PI / 2, (1.5 * rows + 16) * step);
+    int n = (int)ceil(2 * tan(cap / 2) / step);
+    int size = 2 * n;
+    if (context->verbosity > 0)
+    {
+        if (nadir)
+            clog << format(gettext("Filling the nadir cap in %1% × %2% pixels\n")) % size % size;
+        else
+            clog << format(gettext("Filling the zenith cap in %1% × %2% pixels\n")) % size % size;
+    }
+
+    // sample the panorama at the patch pixels, weighting the colours with
+    // their alpha so that holes do not darken their borders
+    size_t planeSize = (size_t)width * height;
+    auto sample = [&](float azimuth, float polar)
+    {
+        float u = azimuth / (2 * (float)PI) * width - 0.5f;
+        float v = (nadir ? (float)PI - polar : polar) / (float)PI * height - 0.5f;
+        int x0 = (int)floorf(u);
+        int r0 = (int)floorf(v);
+        float fx = u - x0;
+        float fy = v - r0;
+        t_fpixel sum = {0, 0, 0, 0};
+        float lowest = 1;
+        for (int k = 0; k < 4; k++)
+        {
+            // u lies within [-0.5, width - 0.5]
+            int x = x0 + k % 2;
+            x = x < 0 ? x + width : x >= width ? x - width : x;
+            int r = min(height - 1, max(0, r0 + k / 2));
+            float weight = (k % 2 ? fx : 1 - fx) * (k / 2 ? fy : 1 - fy);
+            t_fpixel q;
+            if (planes != NULL && !compact)
+            {
+                const float* p = plane(0, height - 1 - r) + x;
+                q.r = p[0], q.g = p[planeSize], q.b = p[2 * planeSize], q.a = p[3 * planeSize];
+            }
+            else
+                q = pixel(x, height - 1 - r);
+            sum.r += q.r * q.a * weight;
+            sum.g += q.g * q.a * weight;
+            sum.b += q.b * q.a * weight;
+            sum.a += q.a * weight;
+            lowest = min(lowest, q.a);
+        }
+        if (sum.a != 0)
+        {
+            sum.r /= sum.a;
+            sum.g /= sum.a;
+            sum.b /= sum.a;
+        }
+        // opaque neighbours must stay exactly opaque
+        if (lowest == 1)
+            sum.a = 1;
+        return sum;
+    };
+    // the pixels at the offsets (±a, ±b) and (±b, ±a) from the pole have the
+    // same polar angle and mirrored azimuths, so every pair a <= b needs only
+    // one evaluation of the projection
+    vector<t_fpixel> patch((size_t)size * size);
+    forEachRowBand(context, n, [&](int b0, int b1, int)
+    {
+        const float pi = PI;
+        for (int b = b0; b < b1; b++)
+        {
+            for (int a = 0; a <= b; a++)
+            {
+                float polar = 2 * atanf(hypotf(a + 0.5f, b + 0.5f) * step / 2);
+                float azimuth = atan2f(b + 0.5f, a + 0.5f);
+                int i[2] = {n + a, n - 1 - a};
+                int j[2] = {n + b, n - 1 - b};
+                patch[(size_t)j[0] * size + i[0]] = sample(azimuth, polar);
+                patch[(size_t)j[0] * size + i[1]] = sample(pi - azimuth, polar);
+                patch[(size_t)j[1] * size + i[1]] = sample(pi + azimuth, polar);
+                patch[(size_t)j[1] * size + i[0]] = sample(2 * pi - azimuth, polar);
+                patch[(size_t)i[0] * size + j[0]] = sample(pi / 2 - azimuth, polar);
+                patch[(size_t)i[0] * size + j[1]] = sample(pi / 2 + azimuth, polar);
+                patch[(size_t)i[1] * size + j[1]] = sample(3 * pi / 2 - azimuth, polar);
+                patch[(size_t)i[1] * size + j[0]] = sample(3 * pi / 2 + azimuth, polar);
+            }
+        }
+    });
+
+    {
+        ptrdiff_t stride = (ptrdiff_t)size * sizeof(t_fpixel);
+        image local(context, patch.data(), size, size, stride, FORMAT_FLOAT, pool);
+        local.flat = true;
+        t_stats capStats;
+        complete(&local, stats ? &capStats : NULL);
+        if (stats)
+            stats->levels.insert(stats->levels.end(), capStats.levels.begin(), capStats.levels.end());
+        local.saveToBuffer(patch.data(), stride, FORMAT_FLOAT);
+    }
+
+    // replace the transparent pixels of the cap like alphaBlendUpsampled()
+    vector<float> cosines(width);
+    vector<float> sines(width);
+    for (int x = 0; x < width; x++)
+    {
+        cosines[x] = cos((x + 0.5) / width * 2 * PI);
+        sines[x] = sin((x + 0.5) / width * 2 * PI);
+    }
+    forEachRowBand(context, rows, [&](int r0, int r1, int)
+    {
+        for (int r = r0; r < r1; r++)
+        {
+            int y = nadir ? r : height - 1 - r;
+            float radius = 2 * tan((r + 0.5) * step / 2) / step;
+            for (int x = 0; x < width; x++)
+            {
+                if ((int)pixel(x, y).a != 0 || (planes != NULL && !holes[y / TILE_HEIGHT * tilesX + x / TILE_WIDTH]))
+                    continue;
+                float pu = radius * cosines[x] + n - 0.5f;
+                float pv = radius * sines[x] + n - 0.5f;
+                int i0 = min(size - 2, max(0, (int)floor(pu)));
+                int j0 = min(size - 2, max(0, (int)floor(pv)));
+                float fx = min(1.0f, max(0.0f, pu - i0));
+                float fy = min(1.0f, max(0.0f, pv - j0));
+                t_fpixel* p = &patch[(size_t)j0 * size + i0];
+                t_fpixel q;
+                q.r = (p[0].r * (1 - fx) + p[1].r * fx) * (1 - fy) + (p[size].r * (1 - fx) + p[size + 1].r * fx) * fy;
+                q.g = (p[0].g * (1 - fx) + p[1].g * fx) * (1 - fy) + (p[size].g * (1 - fx) + p[size + 1].g * fx) * fy;
+                q.b = (p[0].b * (1 - fx) + p[1].b * fx) * (1 - fy) + (p[size].b * (1 - fx) + p[size + 1].b * fx) * fy;
+                q.a = (p[0].a * (1 - fx) + p[1].a * fx) * (1 - fy) + (p[size].a * (1 - fx) + p[size + 1].a * fx) * fy;
+                setPixel(x, y, q);
+            }
+            if (planes != NULL)
+                coverRow(y, 0, width);
+        }
+    });
+}
+
+/*
+ * Fills the transparent pixels of an image in memory in place, see the
+ * constructor for images in memory for its layout.  The levels are taken
+ * from the arena of context, which keeps its memory for the next image.
+ * The frames of a sequence can share a plan, see completeSequence().
+ * Returns false if the image is fully transparent or its pyramid needs a
+ * scratch file that cannot be created, see t_context::maxMemory.
+ */
+bool fillBuffer(t_context* context, void* pixels, int width, int height, ptrdiff_t stride,
+                t_format format, t_stats* stats, t_maskPlan* plan)
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    image img(context, pixels, width, height, stride, format, &context->pool);
+    if (stats)
+    {
+        stats->ok = false;
+        stats->width = width;
+        stats->height = height;
+        stats->reserved = context->pool.reserved();
+        stats->load = secondsSince(t0);
+    }
+    if (img.scratchFailed || img.onlyTransparentPixels())
+        return false;
+    t0 = chrono::steady_clock::now();
+    if (plan != NULL)
+        completeSequence(&img, plan, stats);
+    else
+        complete(&img, stats);
+    if (stats)
+        stats->fill = secondsSince(t0);
+    t0 = chrono::steady_clock::now();
+    img.saveToBuffer(pixels, stride, format);
+    if (stats)
+    {
+        stats->save = secondsSince(t0);
+        stats->ok = true;
+    }
+    return true;
+}
+
+/*
+ * Loads the TIFF file name, or the standard input if name is "-", into an
+ * image whose levels are taken from the arena of context, for complete().
+ * Sets *img to the image if it loads and NULL otherwise, and returns why.
+ */
+t_loadResult loadImage(t_context* context, const char* name, image** img)
+{
+    *img = new image(context, name, &context->pool);
+    t_loadResult result = LOAD_OK;
+    if ((*img)->scratchFailed)
+        result = LOAD_NO_SCRATCH_FILE;
+    else if ((*img)->data == NULL && (*img)->planes == NULL)
+        result = LOAD_UNREADABLE;
+    else if ((*img)->onlyTransparentPixels())
+        result = LOAD_TRANSPARENT;
+    if (result != LOAD_OK)
+    {
+        delete *img;
+        *img = NULL;
+    }
+    return result;
+}
+
+/*
+ * Saves img as TIFF file name, or to the standard output if name is "-",
+ * with the sample format of the file it was loaded from.  Returns false if
+ * that fails.
+ */
+bool saveImage(image* img, const char* name)
+{
+    return img->saveToTIFF(name, img->fileFormat);
+}
+
+/*
+ * Saves a level that complete() passed to its callback as TIFF file name,
+ * like saveImage() saves the image itself.  Returns false if that fails.
+ */
+bool saveLevel(const t_filledLevel& level, const char* name)
+{
+    level.handle->level->ensureAllTiles();
+    return level.handle->level->saveToTIFF(name, level.handle->top->fileFormat);
+}
+
+/*
+ * Frees an image of loadImage() and returns its levels to the arena.
+ */
+void freeImage(image* img)
+{
+    delete img;
+}
@@ -0,0 +1,251 @@
+/*
+ * panofill - fills transparent areas in panorama images.
+ * Copyright (C) 2010, 2011, 2018  Benedikt Freisen
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+ * The pixels [x0, x1) of row y.
+ */
+struct t_span
+{
+    int y, x0, x1;
+};
+
+struct t_scratch;
+
+struct t_arenaState;
+
+/*
+ * Memory for the levels of an image pyramid.  The memory for all levels is
+ * reserved at once and handed out like a stack, which matches the order in
+ * which complete() creates and destroys the levels.  It is kept for the next
+ * image that uses the arena, together with one set of scratch rows per
+ * thread.  Its state is private to the library.
+ */
+class arena
+{
+public:
+    arena();
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    ~arena();
+    bool reserve(int width, int height, int threads, int channelBytes = 4, size_t maxMemory = 0);
+    void* allocate(size_t size);
+    void release(void* p);
+    size_t reserved();
+    bool mapped();
+    void evict(const void* p, size_t size);
+    t_scratch& scratch(int worker);
+private:
+    t_arenaState* state;
+};
+
+/*
+ * The part of a panorama whose holes complete() fills; its other holes stay
+ * as they are.  It is the intersection of a rectangle of width × height
+ * pixels at column x and row y, counted from the top left, whose columns
+ * wrap around, the rows whose latitudes lie from south to north in degrees,
+ * and a mask of maskWidth × maskHeight pixels, top row first, whose nonzero
+ * pixels are inside.  The mask is stretched to the size of the panorama.  A
+ * width of 0 and an empty mask do not restrict it.
+ */
+struct t_region
+{
+    t_region();
+    int x;
+    int y;
+    int width;
+    int height;
+    double south;
+    double north;
+    int maskWidth;
+    int maskHeight;
+    std::vector<char> mask;
+    bool limited() const;
+    std::vector<t_span> spans(int imageWidth, int imageHeight) const;
+};
+
+struct t_contextState;
+
+/*
+ * The settings of one user of the library and the arena for the images it
+ * fills.  The library has no other state, so threads with contexts of their
+ * own can fill images at the same time.  With a storageBits of 16 the SIMD
+ * kernels keep all levels as 16 bit normalized integers, without plans, and
+ * compute in floating point, or with fixedPoint in fixed point.  Pyramids
+ * larger than maxMemory bytes (0: no limit) are kept in a scratch file.
+ * With poleCaps, holes near the poles are filled in local projections of the
+ * polar caps, see image::fillPoleCaps().  Only the holes in region are
+ * filled.  state, which is private to the library, keeps the threads of the
+ * kernels between fills.
+ */
+struct t_context
+{
+    t_context();
+    ~t_context();
+    int verbosity;
+    int interpolator;
+    int threads;
+    bool scalarKernels;
+    int storageBits;
+    bool fixedPoint;
+    size_t maxMemory;
+    bool poleCaps;
+    int compression;
+    bool tiledOutput;
+    t_region region;
+    arena pool;
+    t_contextState* state;
+};
+
+/*
+ * Pixel formats of images in memory.  Every pixel consists of red, green,
+ * blue and alpha; float channels range from 0 to 1.
+ */
+enum t_format
+{
+    FORMAT_RGBA8,
+    FORMAT_RGBA16,
+    FORMAT_FLOAT
+};
+
+/*
+ * The fill of one level, reduced to the pixels that the filled pixels of the
+ * finest level depend on: the spans whose colours are computed from the
+ * finer level, with the sums of the weighted alpha values that normalize
+ * them, span by span, and the spans whose colours are interpolated from the
+ * coarser level.  alpha holds the rows of the alpha channel that the next
+ * level reads, rows the index of every row in alpha or -1.  transparent
+ * counts the pixels that were not opaque, if the fill that compiled the plan
+ * kept statistics.
+ */
+struct t_planLevel
+{
+    int width;
+    int height;
+    long long transparent;
+    std::vector<t_span> computed;
+    std::vector<float> sums;
+    std::vector<t_span> blended;
+    std::vector<int> rows;
+    std::vector<float> alpha;
+};
+
+/*
+ * The fill of an image as a chain of sparse linear steps on its colours,
+ * which every image with the same alpha channel shares, see
+ * completeSequence().  checksum identifies the alpha channel, result holds
+ * the filled alpha values of the interpolated pixels of the finest level.
+ */
+struct t_maskPlan
+{
+    t_maskPlan();
+    int width;
+    int height;
+    unsigned long long checksum;
+    std::vector<t_planLevel> levels;
+    std::vector<float> result;
+};
+
+class image;
+
+struct t_levelHandle;
+
+/*
+ * A level of the pyramid that complete() has filled: its depth n, from 0 for
+ * the image itself, and its size.  handle is private to the library and
+ * only valid during the call of t_levelFilled that receives the level.
+ */
+struct t_filledLevel
+{
+    int n;
+    int width;
+    int height;
+    const t_levelHandle* handle;
+};
+
+/*
+ * Called by complete() for every level of the pyramid as soon as it is
+ * filled, from the coarsest to the finest.  Returning false stops the fill
+ * before the finer levels are blended.
+ */
+typedef std::function<bool(const t_filledLevel& level)> t_levelFilled;
+
+/*
+ * Results of loadImage().
+ */
+enum t_loadResult
+{
+    LOAD_OK,
+    LOAD_UNREADABLE,
+    LOAD_NO_SCRATCH_FILE,
+    LOAD_TRANSPARENT
+};
+
+/*
+ * Timings in seconds and memory use of one pyramid level.  downsample is
+ * the time to compute the level from the finer one, blend the time to blend
+ * the coarser level into it, which includes the interpolation.
+ */
+struct t_levelStats
+{
+    int width;
+    int height;
+    long long transparent;
+    size_t bytes;
+    double downsample;
+    double correctAlpha;
+    double blend;
+};
+
+/*
+ * Timings in seconds and memory use of one file.
+ */
+struct t_stats
+{
+    bool ok;
+    int width;
+    int height;
+    size_t reserved;
+    double load;
+    double fill;
+    double save;
+    std::vector<t_levelStats> levels;
+};
+
+const char* simdName();
+t_loadResult loadImage(t_context* context, const char* name, image** img);
+bool saveImage(image* img, const char* name);
+bool saveLevel(const t_filledLevel& level, const char* name);
+void freeImage(image* img);
+bool complete(image* img, t_stats* stats = NULL, const t_levelFilled& filled = t_levelFilled());
+bool completeSequence(image* img, t_maskPlan* plan, t_stats* stats = NULL);
+bool savePlan(const t_maskPlan& plan, const char* name);
+bool loadPlan(t_maskPlan* plan, const char* name);
+bool loadRegionMask(t_region* region, const char* name);
+bool fillBuffer(t_context* context, void* pixels, int width, int height, std::ptrdiff_t stride,
+                t_format format, t_stats* stats = NULL, t_maskPlan* plan = NULL);
+
+#endif
@@ -18,14 +18,34 @@
  */
 
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
-#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 #include "tiffio.h"
-#define PI 3.14159265
+#include "pyramid.h"
+#define PIPELINE_DEPTH 3
+#define MAX_REQUEST_BYTES 4096
+#define ECHOED_REQUEST_BYTES 80
 
 #include <locale>
+#include <errno.h>
+#include <getopt.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <libintl.h>
 #include <boost/format.hpp>
 #define PACKAGE "panofill"
@@ -34,317 +54,964 @@
 using namespace std;
 using boost::format;
 
-int verbosity = 0;
+const char* statsName = NULL;
+bool sequence = false;
+vector<int> previewWidths;
+bool previewOnly = false;
 
-struct t_pixel
+/*
+ * The output compressions and their libtiff codecs.
+ */
+struct t_compression
+{
+    const char* name;
+    int codec;
+};
+
+t_compression compressions[] =
 {
-    unsigned char r, g, b ,a;
+    {"none", COMPRESSION_NONE},
+    {"lzw", COMPRESSION_LZW},
+    {"deflate", COMPRESSION_ADOBE_DEFLATE},
+#ifdef COMPRESSION_ZSTD
+    {"zstd", COMPRESSION_ZSTD},
+#endif
 };
 
-struct t_fpixel
+/*
+ * The long options and the short options they stand for.
+ */
+struct option longOptions[] =
 {
-    float r, g, b ,a;
+    {"stats", required_argument, NULL, 'S'},
+    {"max-memory", required_argument, NULL, 'M'},
+    {"fixed-point", no_argument, NULL, 'I'},
+    {"sequence", no_argument, NULL, 'F'},
+    {"plan", required_argument, NULL, 'P'},
+    {"save-plan", required_argument, NULL, 'W'},
+    {"preview", required_argument, NULL, 'R'},
+    {"preview-only", no_argument, NULL, 'O'},
+    {"region", required_argument, NULL, 'G'},
+    {"latitudes", required_argument, NULL, 'L'},
+    {"region-mask", required_argument, NULL, 'K'},
+    {"serve", required_argument, NULL, 'X'},
+    {"budget", required_argument, NULL, 'B'},
+    {NULL, 0, NULL, 0}
 };
 
-class image
+/*
+ * A queue whose pop() waits until an element is available.
+ */
+template <class T>
+class channel
 {
 public:
-    image(int width, int height, t_fpixel* data, bool manageData = false);
-    image(char* s);
-    ~image();
-    int width;
-    int height;
-    bool manageData;
-    t_fpixel* data;
-    void saveToTIFF(char* s);
-    image* blurredHalfSize();
-    image* doubleSizeN();
-    image* doubleSizeL();
-    void alphaBlend(image* img);
-    void correctAlpha();
-    bool onlyTransparentPixels();
-    bool noTransparentPixels();
+    void push(T value);
+    T pop();
+private:
+    deque<T> items;
+    mutex lock;
+    condition_variable ready;
+};
+
+template <class T>
+void channel<T>::push(T value)
+{
+    lock_guard<mutex> guard(lock);
+    items.push_back(value);
+    ready.notify_one();
+}
+
+template <class T>
+T channel<T>::pop()
+{
+    unique_lock<mutex> guard(lock);
+    ready.wait(guard, [&] { return !items.empty(); });
+    T value = items.front();
+    items.pop_front();
+    return value;
+}
+
+/*
+ * An input file, the output file it is filled into, the image while it is
+ * being processed, the statistics for --stats and the last error message.
+ */
+struct t_job
+{
+    t_job(const string& input = "", const string& output = "");
+    string input;
+    string output;
+    image* img;
+    t_stats stats;
+    string error;
 };
 
+t_job::t_job(const string& input, const string& output) : input(input), output(output), img(NULL), stats()
+{
+}
 
-image::image(int width, int height, t_fpixel* data, bool manageData)
+/*
+ * Prints an error message, preceded by the input file name if several files
+ * are processed, and keeps it in job.
+ */
+void reportError(t_job& job, bool batch, const string& message)
 {
-    image::width = width;
-    image::height = height;
-    image::data = data;
-    image::manageData = manageData;
+    if (batch)
+        cerr << job.input << ": ";
+    cerr << message;
+    job.error = message;
 }
 
-image::image(char* s)
+/*
+ * Loads the input file of job into the given arena.  Returns false if the
+ * image cannot be filled.
+ */
+bool load(t_job& job, const t_context* context, arena* pool, bool batch)
 {
-    data = NULL;
-    TIFF* tif = TIFFOpen(s, "r");
-    if (tif)
+    job.img = new image(context, job.input.c_str(), pool);
+    if (job.img->scratchFailed)
     {
-        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
-        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
-        data = new t_fpixel[width * height];
-        t_pixel* temp = new t_pixel[width * height];
-        TIFFReadRGBAImage(tif, width, height, (uint32*) temp, 0);
-        TIFFClose(tif);
-        for (int y = 0; y < height; y++)
-        {
-            for (int x = 0; x < width; x++)
-            {
-                data[y * width + x].r = (float) temp[y * width + x].r / 255;
-                data[y * width + x].g = (float) temp[y * width + x].g / 255;
-                data[y * width + x].b = (float) temp[y * width + x].b / 255;
-                data[y * width + x].a = (float) temp[y * width + x].a / 255;
-            }
-        }
-        delete temp;
-        manageData = true;
+        reportError(job, batch, gettext("Cannot create the scratch file for the pyramid in $TMPDIR or /tmp\n\n"));
+        delete job.img;
+        return false;
+    }
+    if (job.img->data == NULL && job.img->planes == NULL)
+    {
+        reportError(job, batch, gettext("Error while loading the image\n\n"));
+        delete job.img;
+        return false;
     }
+    if (job.img->onlyTransparentPixels())
+    {
+        reportError(job, batch, gettext("The image is fully transparent\n\n"));
+        delete job.img;
+        return false;
+    }
+    if (!context->scalarKernels && context->verbosity > 0)
+        clog << format(gettext("%1% of %2% tiles contain transparent pixels\n"))
+                % count(job.img->holes.begin(), job.img->holes.end(), 1) % job.img->holes.size();
+    return true;
 }
 
-image::~image()
+/*
+ * Returns s as JSON string.
+ */
+string jsonString(const string& s)
 {
-    if (manageData)
-        delete data;
+    ostringstream out;
+    out << '"';
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c < 0x20)
+            out << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec;
+        else
+            out << c;
+    }
+    out << '"';
+    return out.str();
 }
 
-void image::saveToTIFF(char* s)
-{
-    TIFF* tif2 = TIFFOpen(s, "w");
-    TIFFSetField(tif2, TIFFTAG_IMAGEWIDTH, width);
-    TIFFSetField(tif2, TIFFTAG_IMAGELENGTH, height);
-    TIFFSetField(tif2, TIFFTAG_SAMPLESPERPIXEL, 4);
-    TIFFSetField(tif2, TIFFTAG_BITSPERSAMPLE, 8);
-    TIFFSetField(tif2, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-    TIFFSetField(tif2, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-    TIFFSetField(tif2, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-    TIFFSetField(tif2, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tif2, width * 4));
-    t_pixel* temp = new t_pixel[width];
-    for (int y = 0; y < height; y++)
-    {
-        for (int x = 0; x < width; x++)
+/*
+ * Writes the statistics of all jobs as JSON to the file name, or to the
+ * standard output if name is "-".  Returns false if that fails.
+ */
+bool writeStats(const char* name, const vector<t_job>& jobs, const t_context* context)
+{
+    ofstream file;
+    if (string(name) != "-")
+        file.open(name);
+    ostream& out = file.is_open() ? file : cout;
+    if (string(name) != "-" && !file.is_open())
+        return false;
+    out << fixed << setprecision(6);
+    out << "{\n  \"kernels\": " << jsonString(context->scalarKernels ? "scalar" : simdName())
+        << ",\n  \"threads\": " << context->threads << ",\n  \"files\": [";
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const t_stats& f = jobs[i].stats;
+        out << (i ? "," : "") << "\n    {\n"
+            << "      \"input\": " << jsonString(jobs[i].input) << ",\n"
+            << "      \"output\": " << jsonString(jobs[i].output) << ",\n"
+            << "      \"ok\": " << (f.ok ? "true" : "false") << ",\n"
+            << "      \"width\": " << f.width << ",\n"
+            << "      \"height\": " << f.height << ",\n"
+            << "      \"reservedBytes\": " << f.reserved << ",\n"
+            << "      \"load\": " << f.load << ",\n"
+            << "      \"fill\": " << f.fill << ",\n"
+            << "      \"save\": " << f.save << ",\n"
+            << "      \"levels\": [";
+        for (size_t n = 0; n < f.levels.size(); n++)
         {
-            temp[x].r = data[(height - y - 1) * width + x].r * 255;
-            temp[x].g = data[(height - y - 1) * width + x].g * 255;
-            temp[x].b = data[(height - y - 1) * width + x].b * 255;
-            temp[x].a = data[(height - y - 1) * width + x].a * 255;
+            const t_levelStats& l = f.levels[n];
+            out << (n ? "," : "") << "\n        {\"level\": " << n
+                << ", \"width\": " << l.width << ", \"height\": " << l.height
+                << ", \"transparentPixels\": " << l.transparent << ", \"bytes\": " << l.bytes
+                << ", \"downsample\": " << l.downsample << ", \"correctAlpha\": " << l.correctAlpha
+                << ", \"blend\": " << l.blend << "}";
         }
-        TIFFWriteScanline(tif2, temp, y, 0);
+        out << (f.levels.empty() ? "]" : "\n      ]") << "\n    }";
     }
-    TIFFClose(tif2);
-    delete temp;
+    out << (jobs.empty() ? "]" : "\n  ]") << "\n}\n";
+    return !out.fail();
 }
 
-image* image::blurredHalfSize()
+/*
+ * Returns the name of the preview of the given width of output: output with
+ * _previewW inserted before its extension.
+ */
+string previewName(const string& output, int width)
 {
-    int w = (width + 1) / 2;
-    int h = (height + 1) / 2;
-    t_fpixel* temp = new t_fpixel[w * h];
-    for (int y = 0; y < h; y++)
+    size_t dot = output.rfind('.');
+    if (dot == string::npos || (output.rfind('/') != string::npos && dot < output.rfind('/')))
+        dot = output.size();
+    return output.substr(0, dot) + "_preview" + to_string(width) + output.substr(dot);
+}
+
+/*
+ * Fills the image of job and saves the level of its pyramid for every preview
+ * width as soon as it is filled: the smallest level that is at least as wide,
+ * or the image itself.  With --preview-only the fill stops after the largest
+ * preview.  Returns false if a preview cannot be saved.
+ */
+bool fillWithPreviews(t_job& job, const t_context* context, bool batch)
+{
+    vector<bool> written(previewWidths.size(), false);
+    bool ok = true;
+    complete(job.img, statsName != NULL ? &job.stats : NULL, [&](const t_filledLevel& level)
     {
-        float fw = 4.0 / (cos((0.5 + (double)y - (double)h / 2) / (double)h * PI));
-        //if (y % 50 == 0) clog << fw << " ";
-        if (verbosity > 1)
-            clog << "   " << fixed << setprecision(2) << (float)y / h * 100 << "%          \r";
-        for (int x = 0; x < w; x++)
+        bool all = true;
+        for (size_t i = 0; i < previewWidths.size(); i++)
         {
-            float r = 0;
-            float g = 0;
-            float b = 0;
-            float a = 0;
-            float total = 0;
-            for (int v = y * 2 - 3; v <= y * 2 + 4; v++)
+            if (!written[i] && (level.width >= previewWidths[i] || level.n == 0))
             {
-                float dy = ((float)(v - y * 2) - 0.5) / 4;
-                float weighty = 1 + dy*dy*dy*dy - 2*dy*dy;
-                for (int u = x * 2 + 1 - fw; u <= x * 2 + fw; u += fw / 4)
+                string name = previewName(job.output, previewWidths[i]);
+                if (context->verbosity > 0)
+                    clog << format(gettext("Writing the preview %1% (%2% × %3% pixels)\n"))
+                            % name % level.width % level.height;
+                if (!saveLevel(level, name.c_str()))
                 {
-                    float dx = ((float)(u - x * 2) - 0.5) / fw;
-                    float weightx = 1 + dx*dx*dx*dx - 2*dx*dx;
-                    float weight = weightx * weighty;
-                    int p = u;
-                    while (p < 0)
-                        p += width;
-                    p = p % width;
-                    int q = v;
-                    if (q < 0)
-                    {
-                        q = -1 - q;
-                        p = width - p - 1;
-                    }
-                    if (q >= height)
-                    {
-                        q = 2 * height - q - 1;
-                        p = width - p - 1;
-                    }
-                    if (q < 0)
-                        q = 0;
-                    if (q >= height)
-                        q = height - 1;
-                    r += data[q * width + p].r * data[q * width + p].a * weight;
-                    g += data[q * width + p].g * data[q * width + p].a * weight;
-                    b += data[q * width + p].b * data[q * width + p].a * weight;
-                    a += data[q * width + p].a * weight;
-                    total += weight;
+                    reportError(job, batch, str(format(gettext("Error while saving the preview %1%\n\n")) % name));
+                    ok = false;
                 }
+                written[i] = true;
             }
-            temp[y * w + x].a = a / total;
-            if (a != 0)
+            all = all && written[i];
+        }
+        return !(previewOnly && all);
+    });
+    return ok;
+}
+
+/*
+ * Fills all jobs in a pipeline of three stages: while one image is filled,
+ * the next one is loaded and the previous one is saved.  Every image keeps
+ * its arena from loading until it is saved, so the number of arenas bounds
+ * the memory in use.  With --sequence the jobs are frames that share the mask
+ * plan, see completeSequence().  With --preview-only the jobs only save their
+ * previews.  Returns false if any job failed.
+ */
+bool processJobs(vector<t_job>& jobs, const t_context* context, t_maskPlan* plan)
+{
+    bool batch = jobs.size() > 1;
+    vector<arena> arenas(min(jobs.size(), (size_t)PIPELINE_DEPTH));
+    channel<arena*> unused;
+    channel<t_job*> loaded;
+    channel<t_job*> filled;
+    atomic<bool> ok(true);
+    for (size_t i = 0; i < arenas.size(); i++)
+        unused.push(&arenas[i]);
+    thread loader([&]
+    {
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            arena* pool = unused.pop();
+            chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+            jobs[i].stats.ok = load(jobs[i], context, pool, batch);
+            jobs[i].stats.load = secondsSince(t0);
+            if (jobs[i].stats.ok)
             {
-                temp[y * w + x].r = r / a;
-                temp[y * w + x].g = g / a;
-                temp[y * w + x].b = b / a;
+                jobs[i].stats.width = jobs[i].img->width;
+                jobs[i].stats.height = jobs[i].img->height;
+                jobs[i].stats.reserved = pool->reserved();
+                loaded.push(&jobs[i]);
             }
             else
             {
-                temp[y * w + x].r = 0;
-                temp[y * w + x].g = 0;
-                temp[y * w + x].b = 0;
+                unused.push(pool);
+                ok = false;
             }
         }
+        loaded.push(NULL);
+    });
+    thread writer([&]
+    {
+        t_job* job;
+        while ((job = filled.pop()) != NULL)
+        {
+            chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+            if (!previewOnly && !job->img->saveToTIFF(job->output.c_str(), job->img->fileFormat))
+            {
+                reportError(*job, batch, gettext("Error while saving the image\n\n"));
+                job->stats.ok = false;
+                ok = false;
+            }
+            job->stats.save = secondsSince(t0);
+            arena* pool = job->img->pool;
+            delete job->img;
+            unused.push(pool);
+        }
+    });
+    t_job* job;
+    while ((job = loaded.pop()) != NULL)
+    {
+        if (batch && context->verbosity > 0)
+            clog << format(gettext("Filling %1%\n")) % job->input;
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        if (!previewWidths.empty())
+        {
+            if (!fillWithPreviews(*job, context, batch))
+            {
+                job->stats.ok = false;
+                ok = false;
+            }
+        }
+        else if (sequence)
+            completeSequence(job->img, plan, statsName != NULL ? &job->stats : NULL);
+        else
+            complete(job->img, statsName != NULL ? &job->stats : NULL);
+        job->stats.fill = secondsSince(t0);
+        filled.push(job);
+    }
+    filled.push(NULL);
+    loader.join();
+    writer.join();
+    if (statsName != NULL && !writeStats(statsName, jobs, context))
+    {
+        cerr << format(gettext("Error while writing the statistics to %1%\n\n")) % statsName;
+        ok = false;
     }
-    return new image(w, h, temp, true);
+    return ok;
 }
 
-image* image::doubleSizeN()
+/*
+ * Appends the pairs of input and output files listed in a manifest, one pair
+ * separated by white space per line.  Empty lines and lines starting with #
+ * are skipped.  Returns false if the manifest cannot be read.
+ */
+bool readManifest(const char* name, vector<t_job>& jobs)
 {
-    int w = width * 2;
-    int h = height * 2;
-    t_fpixel* temp = new t_fpixel[w * h];
-    for (int y = 0; y < h; y++)
+    ifstream manifest(name);
+    if (!manifest)
+        return false;
+    string line;
+    while (getline(manifest, line))
     {
-        for (int x = 0; x < w; x++)
-        {
-            temp[y * w + x].r = data[(y / 2) * width + (x / 2)].r;
-            temp[y * w + x].g = data[(y / 2) * width + (x / 2)].g;
-            temp[y * w + x].b = data[(y / 2) * width + (x / 2)].b;
-            temp[y * w + x].a = data[(y / 2) * width + (x / 2)].a;
-        }
+        istringstream fields(line);
+        t_job job;
+        if (!(fields >> job.input) || job.input[0] == '#')
+            continue;
+        if (!(fields >> job.output))
+            return false;
+        jobs.push_back(job);
     }
-    return new image(w, h, temp, true);
+    return true;
 }
 
-image* image::doubleSizeL()
+/*
+ * Parses a number of bytes with an optional suffix K, M or G for binary
+ * kilo-, mega- or gigabytes.  Returns false if s is no such size.
+ */
+bool parseSize(const char* s, size_t& size)
+{
+    char* end;
+    double value = strtod(s, &end);
+    const char* suffixes = "KMG";
+    double unit = 1;
+    if (*end != 0)
+    {
+        const char* suffix = strchr(suffixes, toupper(*end));
+        if (suffix == NULL || end[1] != 0)
+            return false;
+        unit = (double)(1 << (10 * (suffix - suffixes + 1)));
+    }
+    if (end == s || !(value >= 0))
+        return false;
+    size = (size_t)(value * unit);
+    return true;
+}
+
+/*
+ * Parses count numbers separated by commas.  Returns false if s is no such
+ * list.
+ */
+bool parseNumbers(const char* s, size_t count, vector<double>& values)
+{
+    values.clear();
+    while (values.size() < count)
+    {
+        char* end;
+        values.push_back(strtod(s, &end));
+        if (end == s || *end != (values.size() < count ? ',' : 0))
+            return false;
+        s = end + 1;
+    }
+    return true;
+}
+
+/*
+ * Applies the option c with the argument arg, one of those that control how
+ * a file is filled, to context.  Returns the error message if arg is not
+ * supported and an empty string otherwise.
+ */
+string fillOption(int c, const char* arg, t_context& context)
 {
-    int w = width * 2;
-    int h = height * 2;
-    t_fpixel* temp = new t_fpixel[w * h];
-    for (int y = 0; y < height; y++)
+    vector<double> numbers;
+    switch (c)
     {
-        for (int x = 0; x < width; x++)
+    case 'c':
+        context.compression = -1;
+        for (size_t i = 0; i < sizeof(compressions) / sizeof(compressions[0]); i++)
         {
-	    int xm1 = (x + width - 1) % width;
-	    int xp1 = (x + 1) % width;
-            temp[(y * 2) * w + x * 2].r = (data[y * width + x].r * 9 + data[max(0, y - 1) * width + x].r * 3 + data[max(0, y - 1) * width + xm1].r * 1 + data[y * width + xm1].r * 3) / 16;
-            temp[(y * 2) * w + x * 2].g = (data[y * width + x].g * 9 + data[max(0, y - 1) * width + x].g * 3 + data[max(0, y - 1) * width + xm1].g * 1 + data[y * width + xm1].g * 3) / 16;
-            temp[(y * 2) * w + x * 2].b = (data[y * width + x].b * 9 + data[max(0, y - 1) * width + x].b * 3 + data[max(0, y - 1) * width + xm1].b * 1 + data[y * width + xm1].b * 3) / 16;
-            temp[(y * 2) * w + x * 2].a = (data[y * width + x].a * 9 + data[max(0, y - 1) * width + x].a * 3 + data[max(0, y - 1) * width + xm1].a * 1 + data[y * width + xm1].a * 3) / 16;
-
-	    temp[(y * 2) * w + x * 2 + 1].r = (data[y * width + x].r * 9 + data[max(0, y - 1) * width + x].r * 3 + data[max(0, y - 1) * width + xp1].r * 1 + data[y * width + xp1].r * 3) / 16;
-	    temp[(y * 2) * w + x * 2 + 1].g = (data[y * width + x].g * 9 + data[max(0, y - 1) * width + x].g * 3 + data[max(0, y - 1) * width + xp1].g * 1 + data[y * width + xp1].g * 3) / 16;
-	    temp[(y * 2) * w + x * 2 + 1].b = (data[y * width + x].b * 9 + data[max(0, y - 1) * width + x].b * 3 + data[max(0, y - 1) * width + xp1].b * 1 + data[y * width + xp1].b * 3) / 16;
-	    temp[(y * 2) * w + x * 2 + 1].a = (data[y * width + x].a * 9 + data[max(0, y - 1) * width + x].a * 3 + data[max(0, y - 1) * width + xp1].a * 1 + data[y * width + xp1].a * 3) / 16;
-
-	    temp[(y * 2 + 1) * w + x * 2].r = (data[y * width + x].r * 9 + data[min(height - 1, y + 1) * width + x].r * 3 + data[min(height - 1, y + 1) * width + xm1].r * 1 + data[y * width + xm1].r * 3) / 16;
-            temp[(y * 2 + 1) * w + x * 2].g = (data[y * width + x].g * 9 + data[min(height - 1, y + 1) * width + x].g * 3 + data[min(height - 1, y + 1) * width + xm1].g * 1 + data[y * width + xm1].g * 3) / 16;
-            temp[(y * 2 + 1) * w + x * 2].b = (data[y * width + x].b * 9 + data[min(height - 1, y + 1) * width + x].b * 3 + data[min(height - 1, y + 1) * width + xm1].b * 1 + data[y * width + xm1].b * 3) / 16;
-            temp[(y * 2 + 1) * w + x * 2].a = (data[y * width + x].a * 9 + data[min(height - 1, y + 1) * width + x].a * 3 + data[min(height - 1, y + 1) * width + xm1].a * 1 + data[y * width + xm1].a * 3) / 16;
-
-	    temp[(y * 2 + 1) * w + x * 2 + 1].r = (data[y * width + x].r * 9 + data[min(height - 1, y + 1) * width + x].r * 3 + data[min(height - 1, y + 1) * width + xp1].r * 1 + data[y * width + xp1].r * 3) / 16;
-	    temp[(y * 2 + 1) * w + x * 2 + 1].g = (data[y * width + x].g * 9 + data[min(height - 1, y + 1) * width + x].g * 3 + data[min(height - 1, y + 1) * width + xp1].g * 1 + data[y * width + xp1].g * 3) / 16;
-	    temp[(y * 2 + 1) * w + x * 2 + 1].b = (data[y * width + x].b * 9 + data[min(height - 1, y + 1) * width + x].b * 3 + data[min(height - 1, y + 1) * width + xp1].b * 1 + data[y * width + xp1].b * 3) / 16;
-	    temp[(y * 2 + 1) * w + x * 2 + 1].a = (data[y * width + x].a * 9 + data[min(height - 1, y + 1) * width + x].a * 3 + data[min(height - 1, y + 1) * width + xp1].a * 1 + data[y * width + xp1].a * 3) / 16;
+            if (string(arg) == compressions[i].name && TIFFIsCODECConfigured(compressions[i].codec))
+                context.compression = compressions[i].codec;
         }
+        if (context.compression == -1)
+            return str(format(gettext("Unsupported compression: %1%\n\n")) % arg);
+        break;
+    case 'd':
+        context.storageBits = atoi(arg);
+        if (context.storageBits != 16 && context.storageBits != 32)
+            return str(format(gettext("Unsupported storage depth: %1%\n\n")) % arg);
+        break;
+    case 'j':
+        context.threads = atoi(arg);
+        if (context.threads < 1)
+            context.threads = max(1u, thread::hardware_concurrency());
+        break;
+    case 'n':
+        context.interpolator = 0;
+        break;
+    case 'p':
+        context.poleCaps = true;
+        break;
+    case 's':
+        context.scalarKernels = true;
+        break;
+    case 't':
+        context.tiledOutput = true;
+        break;
+    case 'I':
+        context.storageBits = 16;
+        context.fixedPoint = true;
+        break;
+    case 'M':
+        if (!parseSize(arg, context.maxMemory))
+            return str(format(gettext("Unsupported memory size: %1%\n\n")) % arg);
+        break;
+    case 'G':
+        if (!parseNumbers(arg, 4, numbers) || numbers[2] < 1 || numbers[3] < 1)
+            return str(format(gettext("Unsupported region: %1%\n\n")) % arg);
+        context.region.x = numbers[0];
+        context.region.y = numbers[1];
+        context.region.width = numbers[2];
+        context.region.height = numbers[3];
+        break;
+    case 'L':
+        if (!parseNumbers(arg, 2, numbers) || !(numbers[0] >= -90 && numbers[0] < numbers[1] && numbers[1] <= 90))
+            return str(format(gettext("Unsupported latitudes: %1%\n\n")) % arg);
+        context.region.south = numbers[0];
+        context.region.north = numbers[1];
+        break;
+    case 'K':
+        if (!loadRegionMask(&context.region, arg))
+            return str(format(gettext("Error while reading the region mask %1%\n\n")) % arg);
+        break;
     }
-    return new image(w, h, temp, true);
+    return "";
+}
+
+/*
+ * A client of --serve.  The results of its jobs are sent by the workers that
+ * fill them, so sending is serialized.  The socket is closed with the last
+ * reference.
+ */
+struct t_connection
+{
+    int fd;
+    mutex lock;
+    ~t_connection();
+    void send(const string& line);
+};
+
+t_connection::~t_connection()
+{
+    close(fd);
 }
 
-void image::alphaBlend(image* img)
+/*
+ * Sends line to the client.  A client that has gone away is ignored.
+ */
+void t_connection::send(const string& line)
 {
-    for (int y = 0; y < height; y++)
+    lock_guard<mutex> guard(lock);
+    size_t sent = 0;
+    while (sent < line.size())
     {
-        for (int x = 0; x < width; x++)
+        ssize_t n = ::send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        sent += n;
+    }
+}
+
+/*
+ * A job that a client of --serve sent, with its own settings, the memory it
+ * is charged with while it runs and the arena it is filled in.
+ */
+struct t_request
+{
+    t_job job;
+    t_context context;
+    shared_ptr<t_connection> connection;
+    size_t bytes;
+    arena* pool;
+};
+
+/*
+ * The state of --serve: the requests in the order they arrived, the requests
+ * admitted to the workers, the arenas that no running job uses, so that
+ * their memory stays allocated for the next jobs, and the memory charged to
+ * the running jobs.
+ */
+struct t_server
+{
+    const t_context* defaults;
+    size_t budget;
+    int workers;
+    int listener;
+    channel<t_request*> requests;
+    channel<t_request*> admitted;
+    mutex lock;
+    condition_variable changed;
+    bool stopping;
+    int queued;
+    int running;
+    int clients;
+    size_t used;
+    vector<arena*> idle;
+    vector<weak_ptr<t_connection> > connections;
+};
+
+/*
+ * Copies all settings of from to to, but not its arena and threads.
+ */
+void copySettings(t_context& to, const t_context& from)
+{
+    to.verbosity = from.verbosity;
+    to.interpolator = from.interpolator;
+    to.threads = from.threads;
+    to.scalarKernels = from.scalarKernels;
+    to.storageBits = from.storageBits;
+    to.fixedPoint = from.fixedPoint;
+    to.maxMemory = from.maxMemory;
+    to.poleCaps = from.poleCaps;
+    to.compression = from.compression;
+    to.tiledOutput = from.tiledOutput;
+    to.region = from.region;
+}
+
+/*
+ * Returns the memory that the pyramid of the TIFF file name takes with the
+ * given settings, about 4/3 of the finest level but at most maxMemory if it
+ * is kept in a scratch file, or 0 if the file cannot be read.
+ */
+size_t pyramidBytes(const char* name, const t_context* context)
+{
+    TIFF* tif = TIFFOpen(name, "r");
+    if (tif == NULL)
+        return 0;
+    uint32 width = 0, height = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFClose(tif);
+    size_t channelBytes = !context->scalarKernels && context->storageBits == 16 ? 2 : 4;
+    size_t size = (size_t)width * height * 4 * channelBytes / 3 * 4;
+    if (context->maxMemory > 0 && size > context->maxMemory)
+        size = context->maxMemory;
+    return size;
+}
+
+/*
+ * Returns the start of the request line for an error message, cut after at
+ * most ECHOED_REQUEST_BYTES bytes at the start of a UTF-8 character.
+ */
+string echoedRequest(const string& line)
+{
+    if (line.size() <= ECHOED_REQUEST_BYTES)
+        return line;
+    size_t cut = ECHOED_REQUEST_BYTES - 3;
+    while (cut > 0 && (line[cut] & 0xC0) == 0x80)
+        cut--;
+    return line.substr(0, cut) + "...";
+}
+
+/*
+ * Reads the request "fill INPUT OUTPUT [OPTIONS]" into request, whose
+ * settings start as those of the server.  OPTIONS are those of fillOption().
+ * INPUT and OUTPUT cannot be -, which would be the standard input and output
+ * of the server.  Returns the error message if the request is not supported.
+ * getopt() is not reentrant, so the clients parse one request at a time.
+ */
+string parseRequest(const string& line, const t_context* defaults, t_request* request)
+{
+    static mutex parsing;
+    istringstream fields(line);
+    vector<string> words;
+    string word;
+    while (fields >> word)
+        words.push_back(word);
+    if (words.size() < 3 || words[0] != "fill" || words[1] == "-" || words[2] == "-")
+        return str(format(gettext("Unsupported request: %1%\n\n")) % echoedRequest(line));
+    request->job.input = words[1];
+    request->job.output = words[2];
+    copySettings(request->context, *defaults);
+    // OUTPUT takes the place of the program name
+    vector<char*> args;
+    for (size_t i = 2; i < words.size(); i++)
+        args.push_back(&words[i][0]);
+    args.push_back(NULL);
+    lock_guard<mutex> guard(parsing);
+    optind = 0;
+    int c;
+    while ((c = getopt_long(args.size() - 1, args.data(), "c:d:j:npst", longOptions, NULL)) != -1)
+    {
+        if (strchr("cdjnpstIMGLK", c) == NULL)
+            return str(format(gettext("Unsupported request: %1%\n\n")) % echoedRequest(line));
+        string error = fillOption(c, optarg, request->context);
+        if (!error.empty())
+            return error;
+    }
+    if (optind < (int)args.size() - 1)
+        return str(format(gettext("Unsupported request: %1%\n\n")) % echoedRequest(line));
+    return "";
+}
+
+/*
+ * Returns the result of job as one line of JSON.
+ */
+string jobResult(const t_job& job)
+{
+    ostringstream out;
+    out << fixed << setprecision(6);
+    out << "{\"input\": " << jsonString(job.input) << ", \"output\": " << jsonString(job.output)
+        << ", \"ok\": " << (job.stats.ok ? "true" : "false");
+    if (job.stats.ok)
+        out << ", \"width\": " << job.stats.width << ", \"height\": " << job.stats.height
+            << ", \"load\": " << job.stats.load << ", \"fill\": " << job.stats.fill << ", \"save\": " << job.stats.save;
+    else
+        out << ", \"error\": " << jsonString(job.error.substr(0, job.error.find_last_not_of("\n") + 1));
+    out << "}\n";
+    return out.str();
+}
+
+/*
+ * Stops accepting clients and requests.  The queued jobs are still filled.
+ */
+void stopServer(t_server& server)
+{
+    lock_guard<mutex> guard(server.lock);
+    if (server.stopping)
+        return;
+    server.stopping = true;
+    server.requests.push(NULL);
+    shutdown(server.listener, SHUT_RDWR);
+    for (size_t i = 0; i < server.connections.size(); i++)
+    {
+        shared_ptr<t_connection> connection = server.connections[i].lock();
+        if (connection)
+            shutdown(connection->fd, SHUT_RD);
+    }
+}
+
+/*
+ * Handles the requests of a client line by line until it closes the
+ * connection: "fill INPUT OUTPUT [OPTIONS]" queues a job, whose result is
+ * sent when it is done, "status" sends the state of the server and
+ * "shutdown" stops it after the queued jobs.  A line longer than
+ * MAX_REQUEST_BYTES is rejected and skipped up to its end without being kept.
+ */
+void serveClient(t_server& server, shared_ptr<t_connection> connection)
+{
+    string buffer;
+    bool skipping = false;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read(connection->fd, chunk, sizeof(chunk))) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        buffer.append(chunk, n);
+        size_t end;
+        while ((end = buffer.find('\n')) != string::npos || buffer.size() > MAX_REQUEST_BYTES)
         {
-            int alpha = data[y * width + x].a;
-            data[y * width + x].r = data[y * width + x].r * alpha + img->data[y * img->width + x].r * (1.0 - alpha);
-            data[y * width + x].g = data[y * width + x].g * alpha + img->data[y * img->width + x].g * (1.0 - alpha);
-            data[y * width + x].b = data[y * width + x].b * alpha + img->data[y * img->width + x].b * (1.0 - alpha);
-            data[y * width + x].a = alpha + img->data[y * img->width + x].a * (1.0 - alpha);
+            if (skipping || end == string::npos || end > MAX_REQUEST_BYTES)
+            {
+                if (!skipping)
+                {
+                    t_job rejected;
+                    rejected.error = str(format(gettext("Request longer than %1% bytes\n\n")) % MAX_REQUEST_BYTES);
+                    connection->send(jobResult(rejected));
+                }
+                skipping = end == string::npos;
+                buffer.erase(0, end == string::npos ? buffer.size() : end + 1);
+                continue;
+            }
+            string line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            if (line.find_first_not_of(" \t") == string::npos)
+                continue;
+            if (line == "status")
+            {
+                lock_guard<mutex> guard(server.lock);
+                connection->send(str(format("{\"queued\": %1%, \"running\": %2%, \"usedBytes\": %3%, "
+                                            "\"budgetBytes\": %4%}\n")
+                                     % server.queued % server.running % server.used % server.budget));
+                continue;
+            }
+            if (line == "shutdown")
+            {
+                connection->send("{\"shutdown\": true}\n");
+                stopServer(server);
+                continue;
+            }
+            t_request* request = new t_request();
+            request->connection = connection;
+            request->job.error = parseRequest(line, server.defaults, request);
+            unique_lock<mutex> guard(server.lock);
+            if (request->job.error.empty() && server.stopping)
+                request->job.error = gettext("The server is shutting down\n\n");
+            if (!request->job.error.empty())
+            {
+                guard.unlock();
+                connection->send(jobResult(request->job));
+                delete request;
+                continue;
+            }
+            server.queued++;
+            server.requests.push(request);
         }
     }
+    lock_guard<mutex> guard(server.lock);
+    server.clients--;
+    server.changed.notify_all();
 }
 
-void image::correctAlpha()
+/*
+ * Returns the idle arena in which a pyramid of the given bytes grows the
+ * least: the smallest one that holds them, or else the largest one, or
+ * idle.end() if there is none.
+ */
+vector<arena*>::iterator idleArena(vector<arena*>& idle, size_t bytes)
 {
-    for (int y = 0; y < height; y++)
+    vector<arena*>::iterator best = idle.end();
+    for (vector<arena*>::iterator i = idle.begin(); i != idle.end(); ++i)
     {
-        for (int x = 0; x < width; x++)
+        if (best == idle.end())
+            best = i;
+        else if ((*best)->reserved() >= bytes)
         {
-            data[y * width + x].a = min(1.0f, data[y * width + x].a * 5);
+            if ((*i)->reserved() >= bytes && (*i)->reserved() < (*best)->reserved())
+                best = i;
         }
+        else if ((*i)->reserved() > (*best)->reserved())
+            best = i;
     }
+    return best;
 }
 
-bool image::onlyTransparentPixels()
+/*
+ * Admits the requests in the order they arrived, each as soon as a worker is
+ * free and the memory of the running jobs and its own fits into the budget,
+ * or when no job is running.  It is filled in the idle arena that idleArena()
+ * chooses, and charged with its estimated pyramid or the memory that arena
+ * already holds, whichever is more.  Idle arenas are freed while the memory
+ * they hold would exceed the budget.
+ */
+void dispatch(t_server& server)
 {
-    for (int y = 0; y < height; y++)
+    t_request* request;
+    while ((request = server.requests.pop()) != NULL)
     {
-        for (int x = 0; x < width; x++)
+        size_t bytes = pyramidBytes(request->job.input.c_str(), &request->context);
+        unique_lock<mutex> guard(server.lock);
+        vector<arena*>& idle = server.idle;
+        vector<arena*>::iterator pool;
+        server.changed.wait(guard, [&]
+        {
+            pool = idleArena(idle, bytes);
+            request->bytes = max(bytes, pool != idle.end() ? (*pool)->reserved() : 0);
+            return server.running == 0
+                || (server.running < server.workers && server.used + request->bytes <= server.budget);
+        });
+        server.queued--;
+        server.running++;
+        server.used += request->bytes;
+        if (pool != idle.end())
+        {
+            request->pool = *pool;
+            idle.erase(pool);
+        }
+        else
+            request->pool = new arena();
+        size_t held = server.used;
+        for (size_t i = 0; i < idle.size(); i++)
+            held += idle[i]->reserved();
+        while (held > server.budget && !idle.empty())
         {
-            if (data[y * width + x].a != 0)
-                return false;
+            held -= idle.back()->reserved();
+            delete idle.back();
+            idle.pop_back();
         }
+        guard.unlock();
+        server.admitted.push(request);
     }
-    return true;
+    for (int i = 0; i < server.workers; i++)
+        server.admitted.push(NULL);
 }
 
-bool image::noTransparentPixels()
+/*
+ * Fills the admitted requests one after another and sends their results.
+ * The settings of each request are copied into a context of the worker, so
+ * that the threads it keeps are reused from job to job.
+ */
+void work(t_server& server)
 {
-    for (int y = 0; y < height; y++)
+    t_context context;
+    t_request* request;
+    while ((request = server.admitted.pop()) != NULL)
     {
-        for (int x = 0; x < width; x++)
+        t_job& job = request->job;
+        copySettings(context, request->context);
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        job.stats.ok = load(job, &context, request->pool, true);
+        job.stats.load = secondsSince(t0);
+        if (job.stats.ok)
         {
-            if (data[y * width + x].a != 1.0)
-                return false;
+            job.stats.width = job.img->width;
+            job.stats.height = job.img->height;
+            t0 = chrono::steady_clock::now();
+            complete(job.img);
+            job.stats.fill = secondsSince(t0);
+            t0 = chrono::steady_clock::now();
+            if (!job.img->saveToTIFF(job.output.c_str(), job.img->fileFormat))
+            {
+                reportError(job, true, gettext("Error while saving the image\n\n"));
+                job.stats.ok = false;
+            }
+            job.stats.save = secondsSince(t0);
+            delete job.img;
         }
+        request->connection->send(jobResult(job));
+        lock_guard<mutex> guard(server.lock);
+        server.running--;
+        server.used -= request->bytes;
+        server.idle.push_back(request->pool);
+        server.changed.notify_all();
+        delete request;
     }
-    return true;
 }
 
-//------------------------------
-
-int interpolator = 1;
-
-bool complete(image* img, int n = 0)
+/*
+ * Runs the worker of --serve on the Unix socket path until a client sends
+ * "shutdown".  Up to max(2, cores / threads) jobs run at the same time, so
+ * that one can be loaded or saved while another is filled, as long as their
+ * pyramids take at most budget bytes, see dispatch().  The arenas of finished
+ * jobs are kept for the next ones.  Returns false if the socket cannot be opened.
+ */
+bool serve(const char* path, const t_context* context, size_t budget)
 {
-    if (verbosity > 0)
-        clog << format(gettext("Enter recursion depth %1% (%2% × %3% pixels)\n")) % n % img->width % img->height;
-    if (img->noTransparentPixels())
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return false;
+    strcpy(address.sun_path, path);
+    // a socket that no server answers on is left over from an earlier one
+    struct stat status;
+    if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode))
     {
-        if (verbosity > 0)
-            clog << format(gettext("No transparent pixels in depth %1%\n")) % n;
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe >= 0 && connect(probe, (sockaddr*)&address, sizeof(address)) != 0)
+            unlink(path);
+        if (probe >= 0)
+            close(probe);
     }
-    else
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        return false;
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
     {
-        image* lowRes = img->blurredHalfSize();
-        lowRes->correctAlpha();
-        complete(lowRes, n + 1);
-        image* highRes;
-        if (interpolator == 1)
-            highRes = lowRes->doubleSizeL();
-        else
-            highRes = lowRes->doubleSizeN();
-        img->alphaBlend(highRes);
-        lowRes->~image();
-        highRes->~image();
+        close(listener);
+        return false;
+    }
+
+    t_server server;
+    server.defaults = context;
+    server.budget = budget;
+    server.workers = max(2, (int)thread::hardware_concurrency() / context->threads);
+    server.listener = listener;
+    server.stopping = false;
+    server.queued = server.running = server.clients = 0;
+    server.used = 0;
+    if (context->verbosity > 0)
+        clog << format(gettext("Serving on %1% with up to %2% jobs at once\n")) % path % server.workers;
+    thread dispatcher(dispatch, ref(server));
+    vector<thread> workers;
+    for (int i = 0; i < server.workers; i++)
+        workers.push_back(thread(work, ref(server)));
+    for (;;)
+    {
+        int fd = accept(listener, NULL, NULL);
+        unique_lock<mutex> guard(server.lock);
+        if (fd < 0 && !server.stopping && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+        if (fd < 0 || server.stopping)
+        {
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        shared_ptr<t_connection> connection(new t_connection());
+        connection->fd = fd;
+        server.connections.erase(remove_if(server.connections.begin(), server.connections.end(),
+                                           [](const weak_ptr<t_connection>& c) { return c.expired(); }),
+                                 server.connections.end());
+        server.connections.push_back(connection);
+        server.clients++;
+        thread(serveClient, ref(server), connection).detach();
     }
-    if (verbosity > 0)
-        clog << format(gettext("Leave recursion depth %1%\n")) % n;
+    stopServer(server);
+    dispatcher.join();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    unique_lock<mutex> guard(server.lock);
+    server.changed.wait(guard, [&] { return server.clients == 0; });
+    for (size_t i = 0; i < server.idle.size(); i++)
+        delete server.idle[i];
+    close(listener);
+    unlink(path);
     return true;
 }
 
-//------------------------------
-
 int main(int argc, char** argv)
 {
     setlocale(LC_ALL, "");
@@ -356,66 +1023,244 @@ int main(int argc, char** argv)
 
     char* iname = NULL;
     char* oname = NULL;
+    char* manifest = NULL;
+    char* planName = NULL;
+    char* savePlanName = NULL;
+    char* serveName = NULL;
+    size_t budget = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+    string error;
+    bool batch = false;
+    t_context context;
     int c;
 
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "o:hnvq")) != -1)
+    while ((c = getopt_long(argc, argv, "o:bc:d:j:m:hnpstvq", longOptions, NULL)) != -1)
     {
         switch (c)
         {
         case 'o':
             oname = optarg;
             break;
+        case 'b':
+            batch = true;
+            break;
+        case 'c':
+        case 'd':
+        case 'j':
+        case 'n':
+        case 'p':
+        case 's':
+        case 't':
+        case 'I':
+        case 'M':
+        case 'G':
+        case 'L':
+        case 'K':
+            error = fillOption(c, optarg, context);
+            if (!error.empty())
+            {
+                cerr << error;
+                return 1;
+            }
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
         case 'h':
-            cout << gettext("    panofill -o OUTPUT [-h -n -v -q] INPUT\n\n");
+            cout << gettext("    panofill -o OUTPUT [-c C -d D -j N -h -n -p -s -t -v -q] INPUT\n"
+                            "    panofill -b [-c C -d D -j N -n -p -s -t -v -q] INPUT OUTPUT [INPUT OUTPUT ...]\n"
+                            "    panofill -m MANIFEST [-c C -d D -j N -n -p -s -t -v -q]\n"
+                            "    panofill --serve=SOCKET [-c C -d D -j N -n -p -s -t -v -q]\n\n");
             cout << gettext("panofill is a program for the automatic completion of spherical\n"
                             "360°×180° panorama images that respects the properties of this projection.\n\n");
-            cout << gettext("-h  Output this help text and quit the program\n"
-                            "-n  Use next neighbour interpolation\n"
-                            "-v  Show more status information (can be specified multiple times)\n"
-                            "-q  Do not show any status information\n\n");
+            cout << gettext("-b    Fill pairs of input and output files given as arguments\n"
+                            "-c C  Compress the output with C (none, lzw, deflate, zstd)\n"
+                            "-d D  Store the image pyramid with D bits per channel (16 or 32, default 32)\n"
+                            "-j N  Use N threads (0: one per processor core)\n"
+                            "-h    Output this help text and quit the program\n"
+                            "-m M  Fill the pairs of input and output files listed in M\n"
+                            "-n    Use next neighbour interpolation\n"
+                            "-p    Fill holes near the poles in local projections of the polar caps\n"
+                            "-s    Use the scalar reference kernels instead of the SIMD ones\n"
+                            "-t    Write a tiled TIFF file\n"
+                            "-v    Show more status information (can be specified multiple times)\n"
+                            "-q    Do not show any status information\n"
+                            "--stats=F\n"
+                            "      Write timings and memory use of every level as JSON to F (-: stdout)\n"
+                            "--fixed-point\n"
+                            "      Compute the 16 bit image pyramid in fixed point, implies -d 16\n"
+                            "--max-memory=S\n"
+                            "      Keep image pyramids larger than S bytes (suffix K, M or G) in a scratch\n"
+                            "      file in $TMPDIR and process them in bands of rows\n"
+                            "--sequence\n"
+                            "      Treat the files as frames of a video: frames with the alpha channel of an\n"
+                            "      earlier one reuse the alpha dependent part of its fill\n"
+                            "--plan=F\n"
+                            "      Start the sequence with the plan in F, implies --sequence\n"
+                            "--save-plan=F\n"
+                            "      Write the plan of the last frame with a new alpha channel to F, implies\n"
+                            "      --sequence\n"
+                            "--preview=W\n"
+                            "      Also write OUTPUT with _previewW before its extension as soon as the\n"
+                            "      smallest level of the pyramid at least W pixels wide is filled (can be\n"
+                            "      specified multiple times)\n"
+                            "--preview-only\n"
+                            "      Stop after the largest preview and do not write OUTPUT\n"
+                            "--region=X,Y,W,H\n"
+                            "      Only fill the holes in the rectangle of W × H pixels at X,Y (from the top\n"
+                            "      left; columns wrap around)\n"
+                            "--latitudes=S,N\n"
+                            "      Only fill the holes between the latitudes S and N in degrees (-90 to 90)\n"
+                            "--region-mask=F\n"
+                            "      Only fill the holes where the image F is brighter than half\n"
+                            "--serve=S\n"
+                            "      Stay in memory and fill the jobs that clients send to the Unix socket S\n"
+                            "      (see the manual)\n"
+                            "--budget=S\n"
+                            "      Run jobs of --serve at once while their pyramids fit in S bytes (suffix\n"
+                            "      K, M or G, default half of the memory)\n\n");
             return 0;
-        case 'n':
-            interpolator = 0;
+        case 'S':
+            statsName = optarg;
+            break;
+        case 'F':
+            sequence = true;
+            break;
+        case 'P':
+            planName = optarg;
+            sequence = true;
+            break;
+        case 'W':
+            savePlanName = optarg;
+            sequence = true;
+            break;
+        case 'R':
+            previewWidths.push_back(atoi(optarg));
+            if (previewWidths.back() < 1)
+            {
+                cerr << format(gettext("Unsupported preview width: %1%\n\n")) % optarg;
+                return 1;
+            }
+            break;
+        case 'O':
+            previewOnly = true;
+            break;
+        case 'X':
+            serveName = optarg;
+            break;
+        case 'B':
+            if (!parseSize(optarg, budget))
+            {
+                cerr << format(gettext("Unsupported memory size: %1%\n\n")) % optarg;
+                return 1;
+            }
             break;
         case 'v':
-            verbosity++;
+            context.verbosity++;
             break;
         case 'q':
-            verbosity = 0;
+            context.verbosity = 0;
             break;
         }
     }
-    if (optind <= argc)
+    if (previewOnly && previewWidths.empty())
     {
-        iname = argv[optind];
+        cerr << gettext("--preview-only needs --preview\n\n");
+        return 1;
     }
-
-    if (iname == NULL)
+    if (!previewWidths.empty() && (sequence || context.poleCaps))
     {
-        cerr << gettext("No input file specified\n\n");
+        cerr << gettext("--preview cannot be combined with -p, --sequence or a plan\n\n");
         return 1;
     }
-    if (oname == NULL)
+    if (serveName != NULL)
     {
-        cerr << gettext("No output file specified\n\n");
-        return 1;
+        if (optind < argc || batch || manifest != NULL || oname != NULL || statsName != NULL || sequence
+            || !previewWidths.empty())
+        {
+            cerr << gettext("--serve cannot be combined with files, -b, -m, -o, --stats, --sequence or --preview\n\n");
+            return 1;
+        }
+        if (!serve(serveName, &context, budget))
+        {
+            cerr << format(gettext("Cannot listen on %1%\n\n")) % serveName;
+            return 1;
+        }
+        return 0;
+    }
+    vector<t_job> jobs;
+    if (manifest != NULL)
+    {
+        if (!readManifest(manifest, jobs))
+        {
+            cerr << format(gettext("Error while reading the manifest %1%\n\n")) % manifest;
+            return 1;
+        }
+    }
+    else if (batch)
+    {
+        if ((argc - optind) % 2 != 0)
+        {
+            cerr << gettext("Every input file needs an output file\n\n");
+            return 1;
+        }
+        for (int i = optind; i < argc; i += 2)
+        {
+            jobs.push_back(t_job(argv[i], argv[i + 1]));
+        }
+    }
+    else
+    {
+        if (optind <= argc)
+        {
+            iname = argv[optind];
+        }
+
+        if (iname == NULL)
+        {
+            cerr << gettext("No input file specified\n\n");
+            return 1;
+        }
+        if (oname == NULL)
+        {
+            cerr << gettext("No output file specified\n\n");
+            return 1;
+        }
+        jobs.push_back(t_job(iname, oname));
     }
 
-    image* img = new image(iname);
-    if (img->data == NULL)
+    // the standard input and output hold one file each
+    int inputs = 0, outputs = 0;
+    for (size_t i = 0; i < jobs.size(); i++)
     {
-        cerr << gettext("Error while loading the image\n\n");
+        inputs += jobs[i].input == "-";
+        outputs += jobs[i].output == "-";
+    }
+    if (inputs > 1 || outputs > 1)
+    {
+        cerr << gettext("Only one input file and one output file can be -\n\n");
         return 1;
     }
-    if (img->onlyTransparentPixels())
+    if (outputs > 0 && ((statsName != NULL && string(statsName) == "-") || !previewWidths.empty()))
     {
-        cerr << gettext("The image is fully transparent\n\n");
+        cerr << gettext("The output file - cannot be combined with --stats=- or --preview\n\n");
         return 1;
     }
-    complete(img);
-    img->saveToTIFF(oname);
 
+    if (!context.scalarKernels && context.verbosity > 0)
+        clog << format(gettext("Using %1% kernels\n")) % simdName();
+    t_maskPlan plan;
+    if (planName != NULL && !loadPlan(&plan, planName))
+    {
+        cerr << format(gettext("Error while reading the plan %1%\n\n")) % planName;
+        return 1;
+    }
+    bool ok = processJobs(jobs, &context, &plan);
+    if (savePlanName != NULL && !savePlan(plan, savePlanName))
+    {
+        cerr << format(gettext("Error while writing the plan %1%\n\n")) % savePlanName;
+        ok = false;
+    }
+    return ok ? 0 : 1;
 }
-
@@ -0,0 +1,6 @@
+# The installed panofill library as the imported target panofill::panofill,
+# together with the libraries that it links.
+INCLUDE(CMakeFindDependencyMacro)
+FIND_DEPENDENCY(TIFF)
+FIND_DEPENDENCY(Threads)
+INCLUDE(${CMAKE_CURRENT_LIST_DIR}/panofillTargets.cmake)
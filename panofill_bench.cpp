@@ -0,0 +1,256 @@
+/*
+ * panofill_bench - measures the throughput of the panofill kernels.
+ * Copyright (C) 2010, 2011, 2018  Benedikt Freisen
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <math.h>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "pyramid.h"
+#define PI 3.14159265
+
+#include <unistd.h>
+
+using namespace std;
+
+int repetitions = 3;
+t_context context;
+
+/*
+ * Returns the comma separated numbers in s.
+ */
+vector<double> parseList(const char* s)
+{
+    vector<double> values;
+    istringstream in(s);
+    string item;
+    while (getline(in, item, ','))
+        values.push_back(atof(item.c_str()));
+    return values;
+}
+
+/*
+ * Returns the colour of the synthetic image at row y, counted from the
+ * bottom, and column x.
+ */
+t_fpixel syntheticPixel(int x, int y, int width, int height, int cap)
+{
+    float latitude = ((float)y / height - 0.5) * PI;
+    float longitude = (float)x / width * 2 * PI;
+    t_fpixel p;
+    p.r = 0.5 + 0.5 * sin(longitude * 3);
+    p.g = 0.5 + 0.5 * cos(latitude * 5);
+    p.b = 0.5 + 0.25 * sin(longitude * 7 + latitude * 11);
+    p.a = y < cap ? 0 : 1;
+    return p;
+}
+
+/*
+ * Returns a synthetic equirectangular image of width × width / 2 pixels with
+ * smooth colours and a transparent nadir cap that covers the given fraction
+ * of the rows.  Its storage is taken from pool.  With 16 bit storage it is
+ * converted from a float copy, like the images of the library.
+ */
+image* syntheticImage(int width, double holes, arena* pool)
+{
+    int height = width / 2;
+    int cap = (int)(holes * height);
+    if (context.storageBits == 16 && !context.scalarKernels)
+    {
+        vector<t_fpixel> pixels((size_t)width * height);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                pixels[(size_t)(height - 1 - y) * width + x] = syntheticPixel(x, y, width, height, cap);
+        return new image(&context, pixels.data(), width, height, (ptrdiff_t)width * sizeof(t_fpixel),
+                         FORMAT_FLOAT, pool);
+    }
+    pool->reserve(width, height, context.threads);
+    image* img;
+    if (context.scalarKernels)
+        img = new image(&context, width, height, (t_fpixel*)pool->allocate((size_t)width * height * sizeof(t_fpixel)));
+    else
+        img = new image(&context, width, height, (float*)pool->allocate((size_t)width * height * 4 * sizeof(float)));
+    img->pool = pool;
+    img->pooled = true;
+    forEachRowBand(&context, height, [&](int y0, int y1, int)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                t_fpixel p = syntheticPixel(x, y, width, height, cap);
+                if (img->planes != NULL)
+                {
+                    img->plane(0, y)[x] = p.r;
+                    img->plane(1, y)[x] = p.g;
+                    img->plane(2, y)[x] = p.b;
+                    img->plane(3, y)[x] = p.a;
+                }
+                else
+                    img->data[(size_t)y * width + x] = p;
+            }
+        }
+    });
+    if (img->planes != NULL)
+        img->findHoles(img->valid);
+    return img;
+}
+
+/*
+ * Returns the shortest time in seconds of `repetitions` calls of kernel.
+ * prepare is called before each of them and is not timed.
+ */
+double measure(const function<void()>& kernel, const function<void()>& prepare = NULL)
+{
+    double best = 0;
+    for (int i = 0; i < repetitions; i++)
+    {
+        if (prepare)
+            prepare();
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        kernel();
+        double t = secondsSince(t0);
+        if (i == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+/*
+ * Prints one line of results.  pixels and bytes are the pixels processed and
+ * the bytes read and written by one call of the kernel.
+ */
+void report(const char* kernel, int width, double holes, double seconds, double pixels, double bytes)
+{
+    cout << left << setw(22) << kernel << right
+         << setw(7) << width << setw(7) << setprecision(0) << fixed << holes * 100 << "%"
+         << setw(11) << setprecision(3) << seconds * 1000
+         << setw(13) << setprecision(1) << pixels / seconds / 1e6
+         << setw(12) << setprecision(2) << bytes / seconds / 1e9 << endl;
+}
+
+/*
+ * Measures every kernel on a synthetic image.  Pixel and byte rates are
+ * relative to the full image, so kernels that skip opaque tiles show their
+ * effective rate.  With planar storage noTransparentPixels and
+ * onlyTransparentPixels only read the alpha ranges of the tiles, which the
+ * kernels record as they write and findHoles recomputes from scratch.
+ */
+void benchmark(int width, double holes)
+{
+    arena pool;
+    image* img = syntheticImage(width, holes, &pool);
+    double pixels = (double)img->width * img->height;
+    double bytes = pixels * (img->compact ? 8 : sizeof(t_fpixel));
+    size_t size = (size_t)img->width * img->height * (img->compact ? 8 : sizeof(t_fpixel));
+    char* storage = img->planes != NULL ? (char*)img->planes : (char*)img->data;
+    vector<char> original(storage, storage + size);
+    auto restore = [&]()
+    {
+        copy(original.begin(), original.end(), storage);
+        if (img->planes != NULL)
+            img->findHoles(img->valid);
+    };
+
+    if (img->planes != NULL)
+        report("findHoles", width, holes, measure([&] { img->findHoles(img->valid); }), pixels, pixels * sizeof(float));
+    report("noTransparentPixels", width, holes, measure([&] { img->noTransparentPixels(); }), pixels, bytes);
+    report("onlyTransparentPixels", width, holes, measure([&] { img->onlyTransparentPixels(); }), pixels, bytes);
+    report("transparentPixels", width, holes, measure([&] { img->transparentPixels(); }), pixels, bytes);
+    report("blurredHalfSize", width, holes, measure([&] { delete img->blurredHalfSize(); }), pixels, bytes * 1.25);
+
+    image* lowRes = img->blurredHalfSize();
+    double lowPixels = (double)lowRes->width * lowRes->height;
+    double lowBytes = lowPixels * (img->compact ? 8 : sizeof(t_fpixel));
+    report("correctAlpha", width, holes, measure([&] { lowRes->correctAlpha(); }), lowPixels, lowBytes * 2);
+    context.interpolator = 1;
+    report("upsampleBlendL", width, holes, measure([&] { img->alphaBlendUpsampled(lowRes); }, restore),
+           pixels, bytes * 2 + lowBytes);
+    context.interpolator = 0;
+    report("upsampleBlendN", width, holes, measure([&] { img->alphaBlendUpsampled(lowRes); }, restore),
+           pixels, bytes * 2 + lowBytes);
+    delete lowRes;
+    delete img;
+}
+
+int main(int argc, char** argv)
+{
+    vector<double> widths = parseList("2048,4096,8192");
+    vector<double> fractions = parseList("0.01,0.1,0.5");
+    int c;
+    while ((c = getopt(argc, argv, "w:f:j:r:d:ish")) != -1)
+    {
+        switch (c)
+        {
+        case 'w':
+            widths = parseList(optarg);
+            break;
+        case 'f':
+            fractions = parseList(optarg);
+            break;
+        case 'j':
+            context.threads = atoi(optarg);
+            if (context.threads < 1)
+                context.threads = max(1u, thread::hardware_concurrency());
+            break;
+        case 'r':
+            repetitions = max(1, atoi(optarg));
+            break;
+        case 'd':
+            context.storageBits = atoi(optarg) == 16 ? 16 : 32;
+            break;
+        case 'i':
+            context.storageBits = 16;
+            context.fixedPoint = true;
+            break;
+        case 's':
+            context.scalarKernels = true;
+            break;
+        default:
+            cout << "    panofill_bench [-w W,W,... -f F,F,... -j N -r N -d BITS -i -s]\n\n"
+                    "-w W  Widths of the synthetic images (default 2048,4096,8192; 32768 needs\n"
+                    "      about 20 GB of memory)\n"
+                    "-f F  Fractions of the rows covered by the transparent nadir cap\n"
+                    "      (default 0.01,0.1,0.5)\n"
+                    "-j N  Use N threads (0: one per processor core)\n"
+                    "-r N  Report the fastest of N runs of each kernel (default 3)\n"
+                    "-d 16 Measure the kernels on 16 bit storage\n"
+                    "-i    Measure the fixed point kernels on 16 bit storage, implies -d 16\n"
+                    "-s    Measure the scalar reference kernels instead of the SIMD ones\n";
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    cout << (context.scalarKernels ? "scalar" : simdName()) << " kernels, "
+         << (context.storageBits == 16 && !context.scalarKernels
+             ? (context.fixedPoint ? "16 bit fixed point, " : "16 bit, ") : "")
+         << context.threads << " threads\n\n";
+    cout << left << setw(22) << "kernel" << right << setw(7) << "width" << setw(8) << "holes"
+         << setw(11) << "ms" << setw(13) << "Mpixel/s" << setw(12) << "GB/s" << endl;
+    for (size_t i = 0; i < widths.size(); i++)
+        for (size_t j = 0; j < fractions.size(); j++)
+            benchmark((int)widths[i], fractions[j]);
+    return 0;
+}
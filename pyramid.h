@@ -0,0 +1,188 @@
+/*
+ * panofill - fills transparent areas in panorama images.
+ * Copyright (C) 2010, 2011, 2018  Benedikt Freisen
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+/*
+ * The image pyramid and its kernels, which the library shares with panofill
+ * and panofill_bench.  Unlike image.h this header is not installed.
+ */
+
+#include <chrono>
+#include <deque>
+#include "tiffio.h"
+#include "image.h"
+
+struct t_pixel
+{
+    unsigned char r, g, b ,a;
+};
+
+struct t_fpixel
+{
+    float r, g, b ,a;
+};
+
+/*
+ * A pixel at column x of row y and its value.
+ */
+struct t_keptPixel
+{
+    int x, y;
+    t_fpixel p;
+};
+
+/*
+ * The horizontal taps of the half size filter for the columns of one row,
+ * in runs of output columns that share them.  Run k covers the columns
+ * start[k] to start[k + 1] - 1, which read the source columns 2x + offsets[j]
+ * with weights[j] for j from first[k] to first[k + 1] - 1; sums[k] is the
+ * sum of those weights.
+ */
+struct t_tapRuns
+{
+    std::vector<int> start;
+    std::vector<int> first;
+    std::vector<int> offsets;
+    std::vector<float> weights;
+    std::vector<float> sums;
+    std::vector<int> next;
+};
+
+/*
+ * Scratch rows of one worker thread.  They keep their memory between calls,
+ * so the kernels only allocate while they grow.  converted holds float
+ * copies of the rows of images with 16 bit storage for the kernels that
+ * compute in floating point; the fixed point kernels read the 16 bit rows.
+ */
+struct t_scratch
+{
+    std::vector<float> column[4];
+    std::vector<unsigned> fixedColumn[4];
+    std::vector<float> row;
+    std::vector<unsigned short> fixedRow;
+    std::vector<unsigned short> fixedEven[4];
+    std::vector<unsigned short> fixedOdd[4];
+    std::vector<unsigned> fixedAcc[4];
+    std::vector<float> even[4];
+    std::vector<float> odd[4];
+    std::vector<float> acc[4];
+    std::vector<float> buffer;
+    std::vector<float> converted[12];
+    t_tapRuns taps;
+};
+
+struct t_levelRecord;
+
+class image
+{
+public:
+    image(const t_context* context, int width, int height, t_fpixel* data, bool manageData = false);
+    image(const t_context* context, int width, int height, float* planes, bool manageData = false);
+    image(const t_context* context, const char* s, arena* pool);
+    image(const t_context* context, const void* pixels, int width, int height, std::ptrdiff_t stride,
+          t_format format, arena* pool);
+    ~image();
+    const t_context* context;
+    int width;
+    int height;
+    bool manageData;
+    t_fpixel* data;
+    float* planes;
+    int tilesX;
+    int tilesY;
+    std::vector<char> valid;
+    std::vector<char> holes;
+    std::vector<char> scope;
+    std::vector<float> alphaMin;
+    std::vector<float> alphaMax;
+    image* source;
+    bool corrected;
+    arena* pool;
+    bool pooled;
+    bool scratchFailed;
+    bool compact;
+    bool flat;
+    t_format fileFormat;
+    t_levelRecord* recording;
+    float* plane(int c, int y = 0);
+    unsigned short* plane16(int c, int y = 0);
+    t_fpixel pixel(int x, int y);
+    void findHoles(const std::vector<char>& tiles);
+    bool saveToTIFF(const char* s, t_format format = FORMAT_RGBA8);
+    void saveToBuffer(void* pixels, std::ptrdiff_t stride, t_format format);
+    image* blurredHalfSize();
+    t_fpixel upsampledN(int x, int y);
+    t_fpixel upsampledL(int x, int y);
+    void alphaBlendUpsampled(image* img);
+    void correctAlpha();
+    bool onlyTransparentPixels();
+    bool noTransparentPixels();
+    long long transparentPixels();
+    std::vector<t_span> holeSpans();
+    bool fillPoleCaps(t_stats* stats = NULL);
+    void ensureAllTiles();
+    std::vector<t_keptPixel> limitToRegion(const t_region& region);
+    void limitHoles(image* target);
+    void restorePixels(const std::vector<t_keptPixel>& pixels);
+    bool matches(const t_maskPlan& plan);
+    bool recordPlan(t_maskPlan* plan, t_stats* stats = NULL);
+    void followPlan(const t_maskPlan& plan, t_stats* stats = NULL);
+private:
+    std::vector<float> rowMin;
+    std::vector<float> rowMax;
+    bool loadTIFF(TIFF* tif);
+    bool allocate(bool planar);
+    void setPixel(int x, int y, const t_fpixel& p);
+    void fillCap(bool nadir, int rows, t_stats* stats);
+    void initTiles(bool computed);
+    float* rowBuffer(int c, int y, std::vector<float>& temp);
+    float* readRow(int c, int y, int x0, int x1, std::vector<float>& temp);
+    void writeRow(int c, int y, int x0, int x1, const float* row);
+    std::function<void(int, int)> evictor(const std::function<void(int, int)>& done);
+    void evictRows(int y0, int y1);
+    void coverRow(int y, int x0, int x1);
+    void summarizeTiles(const std::vector<char>& tiles);
+    std::vector<t_span> tileSpans(const std::vector<char>& tiles);
+    void forEachTileIn(int p0, int p1, int q0, int q1, const std::function<void(int, int)>& visit);
+    void forEachFootprintTile(int lo, int hi, int x0, int x1, int y0, int y1, const std::function<void(int, int)>& visit);
+    void ensureTiles(const std::vector<char>& tiles);
+    void markHoleTiles(std::vector<char>& tiles, int y, int x0, int x1, std::vector<float>& temp);
+    void ensureUpsampleSource(image* target, const std::vector<char>& tiles);
+    void blurTiles(image* result, const std::vector<char>& tiles);
+    void blurRowFixed(image* result, int y, int x0, int x1, const t_tapRuns& runs, int lo, int n, int p0, int p1,
+                      int p2, unsigned** column, unsigned fixedWeights, t_scratch& scratch);
+    void blendSpanFixed(image* img, const t_span& span, int y, int yn, unsigned short* buffer);
+    void blurSpans(image* result, const std::vector<t_span>& spans, const t_planLevel* from = NULL,
+                   const t_planLevel* to = NULL);
+    void correctAlphaTiles(const std::vector<char>& tiles);
+    image* blurredHalfSizePlanar();
+    void alphaBlendUpsampledPlanar(image* img, const std::vector<t_span>* spans = NULL);
+    void record(std::deque<t_levelRecord>* levels);
+    unsigned long long alphaChecksum();
+    void compilePlan(t_maskPlan* plan, std::deque<t_levelRecord>& records, const std::vector<t_span>& holes);
+    void correctAlphaPlanar();
+};
+
+void forEachRowBand(const t_context* context, int rows, const std::function<void(int, int, int)>& kernel,
+                    bool progress = false, const std::function<void(int, int)>& done = NULL);
+double secondsSince(std::chrono::steady_clock::time_point t0);
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * library_test - fills images in memory with the panofill library.
+ * Copyright (C) 2010, 2011, 2018  Benedikt Freisen
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tiffio.h"
+#include "image.h"
+
+using namespace std;
+
+/*
+ * Reads the TIFF file s as 8 bit RGBA, top row first.
+ */
+bool readTIFF(const char* s, int& width, int& height, vector<uint32>& raster)
+{
+    TIFF* tif = TIFFOpen(s, "r");
+    if (tif == NULL)
+        return false;
+    uint32 w, h;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+    width = w;
+    height = h;
+    raster.resize((size_t)w * h);
+    bool ok = TIFFReadRGBAImageOriented(tif, w, h, raster.data(), ORIENTATION_TOPLEFT, 0) != 0;
+    TIFFClose(tif);
+    return ok;
+}
+
+/*
+ * Fills input in the given format with rows padded to a stride of 64 extra
+ * bytes, following plan if one is given, and returns the largest difference
+ * of any 8 bit channel from reference, or 256 if the fill fails or touches
+ * the padding.
+ */
+int fillAndCompare(t_context* context, const vector<uint32>& input, const vector<uint32>& reference,
+                   int width, int height, t_format format, t_maskPlan* plan = NULL)
+{
+    int channelBytes = format == FORMAT_RGBA8 ? 1 : format == FORMAT_RGBA16 ? 2 : 4;
+    ptrdiff_t stride = (ptrdiff_t)width * 4 * channelBytes + 64;
+    vector<char> buffer(stride * height, 0x5a);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            for (int c = 0; c < 4; c++)
+            {
+                unsigned v = (input[(size_t)y * width + x] >> (8 * c)) & 0xff;
+                char* p = &buffer[y * stride + (x * 4 + c) * channelBytes];
+                if (format == FORMAT_RGBA8)
+                    *(unsigned char*)p = v;
+                else if (format == FORMAT_RGBA16)
+                    *(unsigned short*)p = v * 257;
+                else
+                    *(float*)p = (float)v / 255;
+            }
+    if (!fillBuffer(context, buffer.data(), width, height, stride, format, NULL, plan))
+        return 256;
+    int worst = 0;
+    for (int y = 0; y < height; y++)
+    {
+        for (int i = width * 4 * channelBytes; i < stride; i++)
+            if (buffer[y * stride + i] != 0x5a)
+                return 256;
+        for (int x = 0; x < width; x++)
+            for (int c = 0; c < 4; c++)
+            {
+                int v = (reference[(size_t)y * width + x] >> (8 * c)) & 0xff;
+                char* p = &buffer[y * stride + (x * 4 + c) * channelBytes];
+                int w;
+                if (format == FORMAT_RGBA8)
+                    w = *(unsigned char*)p;
+                else if (format == FORMAT_RGBA16)
+                    w = *(unsigned short*)p / 257;
+                else
+                    w = *(float*)p * 255;
+                worst = max(worst, abs(v - w));
+            }
+    }
+    return worst;
+}
+
+/*
+ * Fills the file input with loadImage(), complete() and saveImage() into the
+ * file output and returns the largest difference of any 8 bit channel from
+ * reference, or 256 if that fails or complete() does not end with the image
+ * itself as the last filled level.
+ */
+int fillFileAndCompare(const char* input, const char* output, const vector<uint32>& reference)
+{
+    t_context context;
+    image* img;
+    if (loadImage(&context, input, &img) != LOAD_OK)
+        return 256;
+    t_filledLevel last = {-1, 0, 0, NULL};
+    complete(img, NULL, [&](const t_filledLevel& level)
+    {
+        last = level;
+        return true;
+    });
+    bool saved = saveImage(img, output);
+    freeImage(img);
+    int width, height;
+    vector<uint32> result;
+    if (!saved || last.n != 0 || !readTIFF(output, width, height, result) || result.size() != reference.size() ||
+        last.width != width || last.height != height)
+        return 256;
+    int worst = 0;
+    for (size_t i = 0; i < result.size(); i++)
+        for (int c = 0; c < 4; c++)
+            worst = max(worst, abs((int)((result[i] >> (8 * c)) & 0xff) - (int)((reference[i] >> (8 * c)) & 0xff)));
+    return worst;
+}
+
+/*
+ * Fills a 16 bit image whose only opaque pixels are a black border in fixed
+ * point and returns whether all pixels are exactly black then, which takes
+ * premultiplying the colours in fixed point to keep 0 at 0.
+ */
+bool fillsBlackWithBlack()
+{
+    t_context context;
+    context.storageBits = 16;
+    context.fixedPoint = true;
+    const int width = 300, height = 300;
+    vector<unsigned short> pixels((size_t)width * height * 4, 0);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            if (x == 0 || y == 0 || x == width - 1 || y == height - 1)
+                pixels[((size_t)y * width + x) * 4 + 3] = 65535;
+    if (!fillBuffer(&context, pixels.data(), width, height, width * 8, FORMAT_RGBA16))
+        return false;
+    for (size_t i = 0; i < pixels.size(); i += 4)
+        if (pixels[i] != 0 || pixels[i + 1] != 0 || pixels[i + 2] != 0 || pixels[i + 3] != 65535)
+            return false;
+    return true;
+}
+
+/*
+ * library_test INPUT REFERENCE TOLERANCE fills INPUT in every format, once
+ * with the SIMD and once with the scalar kernels on two threads with a
+ * context each, and compares the results with REFERENCE.  Each thread also
+ * fills INPUT as two frames of a sequence, the second of which follows the
+ * plan of the first.  Finally INPUT is filled as a file, a missing file must
+ * not load, and a hole in opaque black must be filled with black.
+ */
+int main(int argc, char** argv)
+{
+    if (argc != 4)
+    {
+        cerr << "    library_test INPUT REFERENCE TOLERANCE" << endl;
+        return 1;
+    }
+    TIFFSetWarningHandler(NULL);
+    int width, height, referenceWidth, referenceHeight;
+    vector<uint32> input, reference;
+    if (!readTIFF(argv[1], width, height, input) || !readTIFF(argv[2], referenceWidth, referenceHeight, reference)
+        || width != referenceWidth || height != referenceHeight)
+    {
+        cerr << "cannot read " << argv[1] << " and " << argv[2] << endl;
+        return 1;
+    }
+    int tolerance = atoi(argv[3]);
+    const char* names[] = {"RGBA8", "RGBA16", "float"};
+    bool ok = true;
+    for (int format = FORMAT_RGBA8; format <= FORMAT_FLOAT; format++)
+    {
+        int worst[2];
+        vector<thread> workers;
+        for (int i = 0; i < 2; i++)
+        {
+            workers.push_back(thread([&, i]
+            {
+                t_context context;
+                context.threads = 2;
+                context.scalarKernels = i == 1;
+                // a second image reuses the arena of the context
+                worst[i] = max(fillAndCompare(&context, input, reference, width, height, (t_format)format),
+                               fillAndCompare(&context, input, reference, width, height, (t_format)format));
+                t_maskPlan plan;
+                for (int frame = 0; frame < 2; frame++)
+                    worst[i] = max(worst[i], fillAndCompare(&context, input, reference, width, height,
+                                                            (t_format)format, &plan));
+            }));
+        }
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+        for (int i = 0; i < 2; i++)
+        {
+            cout << names[format] << (i ? " scalar" : " SIMD") << ": largest difference " << worst[i] << endl;
+            ok = ok && worst[i] <= tolerance;
+        }
+    }
+    string name = argv[1];
+    string output = "library_" + name.substr(name.rfind('/') + 1);
+    int worst = fillFileAndCompare(argv[1], output.c_str(), reference);
+    cout << "file: largest difference " << worst << endl;
+    ok = ok && worst <= tolerance;
+    t_context context;
+    image* missing;
+    t_loadResult result = loadImage(&context, (output + ".missing").c_str(), &missing);
+    cout << "missing file: " << (result == LOAD_UNREADABLE && missing == NULL ? "unreadable" : "loaded") << endl;
+    ok = ok && result == LOAD_UNREADABLE && missing == NULL;
+    bool black = fillsBlackWithBlack();
+    cout << "opaque black: " << (black ? "black" : "not black") << endl;
+    return ok && black ? 0 : 1;
+}
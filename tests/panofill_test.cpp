@@ -0,0 +1,554 @@
+/*
+ * panofill_test - runs panofill and checks its output, runtime and memory use.
+ * Copyright (C) 2010, 2011, 2018  Benedikt Freisen
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <math.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "tiffio.h"
+#define PI 3.14159265
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+/*
+ * Reads the TIFF file s as 8 bit RGBA, top row first.  libtiff's RGBA
+ * interface cannot read float samples, so RGBA files with 32 bit float
+ * samples are read strip by strip or tile by tile and quantized like
+ * panofill quantizes 8 bit output.
+ */
+bool readTIFF(const char* s, int& width, int& height, vector<uint32>& raster)
+{
+    TIFF* tif = TIFFOpen(s, "r");
+    if (tif == NULL)
+        return false;
+    uint32 w, h;
+    uint16 sampleFormat, samples;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &sampleFormat);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+    width = w;
+    height = h;
+    raster.resize((size_t)w * h);
+    bool ok;
+    if (sampleFormat != SAMPLEFORMAT_IEEEFP)
+        ok = TIFFReadRGBAImageOriented(tif, w, h, raster.data(), ORIENTATION_TOPLEFT, 0) != 0;
+    else
+    {
+        bool tiled = TIFFIsTiled(tif);
+        uint32 chunkWidth = w, chunkHeight;
+        if (tiled)
+        {
+            TIFFGetField(tif, TIFFTAG_TILEWIDTH, &chunkWidth);
+            TIFFGetField(tif, TIFFTAG_TILELENGTH, &chunkHeight);
+        }
+        else
+            TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &chunkHeight);
+        vector<float> chunk((size_t)chunkWidth * chunkHeight * samples);
+        ok = samples == 4;
+        for (uint32 y0 = 0; y0 < h && ok; y0 += chunkHeight)
+        {
+            for (uint32 x0 = 0; x0 < w && ok; x0 += chunkWidth)
+            {
+                tmsize_t bytes = chunk.size() * sizeof(float);
+                ok = (tiled ? TIFFReadEncodedTile(tif, TIFFComputeTile(tif, x0, y0, 0, 0), chunk.data(), bytes)
+                            : TIFFReadEncodedStrip(tif, TIFFComputeStrip(tif, y0, 0), chunk.data(), bytes)) > 0;
+                for (uint32 y = y0; y < min(h, y0 + chunkHeight) && ok; y++)
+                    for (uint32 x = x0; x < min(w, x0 + chunkWidth); x++)
+                    {
+                        uint32 p = 0;
+                        for (int c = 0; c < 4; c++)
+                        {
+                            float v = chunk[((size_t)(y - y0) * chunkWidth + x - x0) * 4 + c];
+                            p |= (uint32)(v <= 0 ? 0 : v >= 1 ? 255 : (int)(v * 255)) << (8 * c);
+                        }
+                        raster[(size_t)y * w + x] = p;
+                    }
+            }
+        }
+    }
+    TIFFClose(tif);
+    return ok;
+}
+
+/*
+ * Writes a synthetic equirectangular panorama of width × width / 2 pixels to
+ * s.  Besides a transparent nadir cap that covers the given fraction of the
+ * rows it has a small zenith hole and elliptical holes at mid latitudes, one
+ * of which crosses the left and right image border.  With polar only the
+ * holes at the poles are made.  Its samples have the given number of bits:
+ * 8 or 16 bit integers or 32 bit floats, all with the same 8 bit values.
+ */
+bool writeSynthetic(const char* s, int width, double holes, bool polar, int bits)
+{
+    int height = width / 2;
+    TIFF* tif = TIFFOpen(s, "w");
+    if (tif == NULL)
+        return false;
+    uint16 extra = EXTRASAMPLE_ASSOCALPHA;
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, bits);
+    if (bits == 32)
+        TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 4);
+    TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, 1, &extra);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, 1);
+    TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+    vector<unsigned char> row((size_t)width * 4);
+    vector<char> samples((size_t)width * 4 * bits / 8);
+    bool ok = true;
+    for (int y = 0; y < height && ok; y++)
+    {
+        double latitude = (0.5 - (double)y / height) * PI;
+        for (int x = 0; x < width; x++)
+        {
+            double longitude = (double)x / width * 2 * PI;
+            double u = (double)x / width, v = (double)y / height;
+            bool hole = y >= height - (int)(holes * height)
+                     || v < 0.02
+                     || (!polar && pow((u - 0.3) / 0.06, 2) + pow((v - 0.4) / 0.08, 2) < 1)
+                     || (!polar && pow((min(u, 1 - u)) / 0.04, 2) + pow((v - 0.6) / 0.05, 2) < 1);
+            unsigned char* p = &row[(size_t)x * 4];
+            p[0] = hole ? 0 : (unsigned char)(127.5 + 127.5 * sin(longitude * 3));
+            p[1] = hole ? 0 : (unsigned char)(127.5 + 127.5 * cos(latitude * 5));
+            p[2] = hole ? 0 : (unsigned char)(127.5 + 63.75 * sin(longitude * 7 + latitude * 11));
+            p[3] = hole ? 0 : 255;
+        }
+        for (size_t i = 0; i < row.size(); i++)
+        {
+            if (bits == 16)
+                ((uint16*)samples.data())[i] = row[i] * 257;
+            else if (bits == 32)
+                ((float*)samples.data())[i] = (float)row[i] / 255;
+            else
+                samples[i] = row[i];
+        }
+        ok = TIFFWriteScanline(tif, samples.data(), y, 0) >= 0;
+    }
+    TIFFClose(tif);
+    return ok;
+}
+
+/*
+ * Starts argv, with in as its standard input and out as its standard output
+ * unless they are -1.  Returns its process id, or -1 if it could not be
+ * started.
+ */
+pid_t start(char** argv, int in = -1, int out = -1)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if ((in >= 0 && dup2(in, STDIN_FILENO) < 0) || (out >= 0 && dup2(out, STDOUT_FILENO) < 0))
+            _exit(127);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+/*
+ * Waits for the process pid, started at t0.  Returns its exit status, or -1
+ * if it did not exit normally.  seconds and rss receive the wall clock time
+ * and the peak resident set size in MB of the child.
+ */
+int finish(pid_t pid, chrono::steady_clock::time_point t0, double& seconds, double& rss)
+{
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid)
+        return -1;
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    rss = usage.ru_maxrss / 1024.0;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+ * Runs argv and waits for it, see finish().  Returns -1 if it could not be
+ * started.
+ */
+int run(char** argv, double& seconds, double& rss)
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    pid_t pid = start(argv);
+    if (pid < 0)
+        return -1;
+    return finish(pid, t0, seconds, rss);
+}
+
+/*
+ * Runs argv with the file input piped to its standard input and its standard
+ * output piped to the file output, see finish().  Returns -1 if it could not
+ * be started.
+ */
+int runPiped(char** argv, const string& input, const string& output, double& seconds, double& rss)
+{
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) != 0)
+        return -1;
+    if (pipe2(out, O_CLOEXEC) != 0)
+    {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    pid_t pid = start(argv, in[0], out[1]);
+    close(in[0]);
+    close(out[1]);
+    // a second process feeds the input, so that the output can be read here
+    pid_t feeder = pid > 0 ? fork() : -1;
+    if (feeder == 0)
+    {
+        ifstream file(input.c_str(), ios::binary);
+        char chunk[65536];
+        while (file.read(chunk, sizeof(chunk)) || file.gcount() > 0)
+            if (write(in[1], chunk, file.gcount()) != file.gcount())
+                _exit(1);
+        _exit(0);
+    }
+    close(in[1]);
+    ofstream file(output.c_str(), ios::binary);
+    char chunk[65536];
+    ssize_t n;
+    while ((n = read(out[0], chunk, sizeof(chunk))) > 0)
+        file.write(chunk, n);
+    close(out[0]);
+    if (feeder > 0)
+        waitpid(feeder, NULL, 0);
+    return pid > 0 ? finish(pid, t0, seconds, rss) : -1;
+}
+
+/*
+ * Sends requests to the server of --serve on the Unix socket path as soon as
+ * it accepts connections, for at most ten seconds, and reads its replies
+ * until it closes the connection.  Returns false if it cannot connect.
+ */
+bool sendRequests(const string& path, const string& requests, string& replies)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    int fd = -1;
+    for (int attempt = 0; attempt < 1000 && fd < 0; attempt++)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (sockaddr*)&address, sizeof(address)) != 0)
+        {
+            close(fd);
+            fd = -1;
+            usleep(10000);
+        }
+    }
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, requests.data(), requests.size()) == (ssize_t)requests.size();
+    char chunk[4096];
+    ssize_t n;
+    while (ok && (n = read(fd, chunk, sizeof(chunk))) > 0)
+        replies.append(chunk, n);
+    close(fd);
+    return ok;
+}
+
+/*
+ * Compares the images in the files a and b.  Fails if their sizes differ or
+ * any channel of any pixel differs by more than tolerance.
+ */
+bool compare(const char* a, const char* b, int tolerance)
+{
+    int wa, ha, wb, hb;
+    vector<uint32> ra, rb;
+    if (!readTIFF(a, wa, ha, ra))
+    {
+        cerr << "cannot read " << a << endl;
+        return false;
+    }
+    if (!readTIFF(b, wb, hb, rb))
+    {
+        cerr << "cannot read " << b << endl;
+        return false;
+    }
+    if (wa != wb || ha != hb)
+    {
+        cerr << a << " is " << wa << "x" << ha << ", " << b << " is " << wb << "x" << hb << endl;
+        return false;
+    }
+    int worst[4] = {0, 0, 0, 0};
+    long long differing = 0;
+    for (size_t i = 0; i < ra.size(); i++)
+    {
+        if (ra[i] == rb[i])
+            continue;
+        differing++;
+        for (int c = 0; c < 4; c++)
+        {
+            int d = abs((int)((ra[i] >> (8 * c)) & 0xff) - (int)((rb[i] >> (8 * c)) & 0xff));
+            worst[c] = max(worst[c], d);
+        }
+    }
+    cout << "differing pixels " << differing << ", largest difference per channel (RGBA) "
+         << worst[0] << " " << worst[1] << " " << worst[2] << " " << worst[3] << endl;
+    return *max_element(worst, worst + 4) <= tolerance;
+}
+
+/*
+ * Returns the median time of the last runs of the test name in the CSV file
+ * log, or 0 if it has none.
+ */
+double typicalSeconds(const string& log, const string& name)
+{
+    ifstream csv(log.c_str());
+    vector<double> times;
+    string line;
+    while (getline(csv, line))
+    {
+        size_t comma = line.find(',');
+        if (comma != string::npos && line.compare(0, comma, name) == 0)
+            times.push_back(atof(line.c_str() + comma + 1));
+    }
+    if (times.size() > 10)
+        times.erase(times.begin(), times.end() - 10);
+    if (times.empty())
+        return 0;
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+int main(int argc, char** argv)
+{
+    string name = "panofill_test", input, reference, log;
+    int width = 0;
+    double holes = 0.1;
+    bool polar = false;
+    int bits = 8;
+    int tolerance = 0;
+    double maxSeconds = 0, maxSlowdown = 0, maxRSS = 0;
+    bool update = false;
+    bool serve = false;
+    bool piped = false;
+    int c;
+    while ((c = getopt(argc, argv, "n:i:g:f:pb:r:t:T:R:M:l:uDPh")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            name = optarg;
+            break;
+        case 'i':
+            input = optarg;
+            break;
+        case 'g':
+            width = atoi(optarg);
+            break;
+        case 'f':
+            holes = atof(optarg);
+            break;
+        case 'p':
+            polar = true;
+            break;
+        case 'b':
+            bits = atoi(optarg);
+            break;
+        case 'r':
+            reference = optarg;
+            break;
+        case 't':
+            tolerance = atoi(optarg);
+            break;
+        case 'T':
+            maxSeconds = atof(optarg);
+            break;
+        case 'R':
+            maxSlowdown = atof(optarg);
+            break;
+        case 'M':
+            maxRSS = atof(optarg);
+            break;
+        case 'l':
+            log = optarg;
+            break;
+        case 'u':
+            update = true;
+            break;
+        case 'D':
+            serve = true;
+            break;
+        case 'P':
+            piped = true;
+            break;
+        default:
+            cout << "    panofill_test [options] -- PANOFILL [ARGS]\n\n"
+                    "Runs PANOFILL ARGS -o NAME_out.tif INPUT and checks the result.\n\n"
+                    "-n NAME  Name of the test and prefix of its files (default panofill_test)\n"
+                    "-i FILE  Use FILE as input\n"
+                    "-g W     Use a generated panorama of W × W/2 pixels as input\n"
+                    "-f F     Fraction of the rows covered by its transparent nadir cap\n"
+                    "         (default 0.1)\n"
+                    "-p       Leave out the holes of the generated panorama away from the poles\n"
+                    "-b BITS  Write the generated panorama with 8, 16 or 32 (float) bits per\n"
+                    "         sample (default 8)\n"
+                    "-r FILE  Compare the output with the reference image FILE\n"
+                    "-t N     Allow a difference of N per 8 bit channel (default 0)\n"
+                    "-T S     Fail if panofill runs longer than S seconds\n"
+                    "-R F     Fail if panofill runs longer than F times the median time of the\n"
+                    "         last ten runs of NAME in the CSV file of -l\n"
+                    "-M MB    Fail if the peak memory use of panofill exceeds MB megabytes\n"
+                    "-l FILE  Append name, time and peak memory use to the CSV file FILE\n"
+                    "-u       Replace the reference image with the output instead\n"
+                    "-D       Run PANOFILL ARGS --serve=NAME.sock instead, send it the job to\n"
+                    "         fill INPUT into NAME_out.tif and NAME_out2.tif and check both\n"
+                    "-P       Run PANOFILL ARGS -o - - instead, with INPUT piped to its standard\n"
+                    "         input and its standard output piped to NAME_out.tif\n";
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || (input.empty() && width <= 0))
+    {
+        cerr << "panofill_test: an input and a command are required, see -h" << endl;
+        return 1;
+    }
+
+    TIFFSetWarningHandler(NULL);
+    cerr << fixed << setprecision(1);
+    if (width > 0)
+    {
+        input = name + "_in.tif";
+        if (!writeSynthetic(input.c_str(), width, holes, polar, bits))
+        {
+            cerr << "cannot write " << input << endl;
+            return 1;
+        }
+    }
+    string output = name + "_out.tif";
+    string output2 = name + "_out2.tif";
+    string socket = name + ".sock";
+    string serveOption = "--serve=" + socket;
+    vector<char*> command(argv + optind, argv + argc);
+    if (serve)
+        command.push_back((char*)serveOption.c_str());
+    else if (piped)
+    {
+        command.push_back((char*)"-o");
+        command.push_back((char*)"-");
+        command.push_back((char*)"-");
+    }
+    else
+    {
+        command.push_back((char*)"-o");
+        command.push_back((char*)output.c_str());
+        command.push_back((char*)input.c_str());
+    }
+    command.push_back(NULL);
+
+    double seconds = 0, rss = 0;
+    int status;
+    if (serve)
+    {
+        // the job is sent twice, the second time to a warm worker
+        string requests = "fill " + input + " " + output + "\nfill " + input + " " + output2 + "\nshutdown\n";
+        string replies;
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        pid_t pid = start(command.data());
+        bool sent = pid > 0 && sendRequests(socket, requests, replies);
+        status = pid > 0 ? finish(pid, t0, seconds, rss) : -1;
+        cout << replies;
+        size_t done = 0;
+        for (size_t i = replies.find("\"ok\": true"); i != string::npos; i = replies.find("\"ok\": true", i + 1))
+            done++;
+        if (status == 0 && (!sent || done != 2))
+        {
+            cerr << "the server did not fill both jobs" << endl;
+            status = 1;
+        }
+    }
+    else if (piped)
+        status = runPiped(command.data(), input, output, seconds, rss);
+    else
+        status = run(command.data(), seconds, rss);
+    cout << fixed << setprecision(3) << "time " << seconds << " s, peak RSS "
+         << setprecision(1) << rss << " MB" << endl;
+    if (status != 0)
+    {
+        cerr << "panofill failed with status " << status << endl;
+        return 1;
+    }
+    double typical = 0;
+    if (!log.empty())
+    {
+        typical = typicalSeconds(log, name);
+        ofstream csv(log.c_str(), ios::app);
+        csv << name << "," << fixed << setprecision(3) << seconds << "," << setprecision(1) << rss << endl;
+    }
+
+    bool ok = true;
+    if (!reference.empty())
+    {
+        if (update)
+        {
+            ifstream in(output.c_str(), ios::binary);
+            ofstream out(reference.c_str(), ios::binary);
+            out << in.rdbuf();
+            cout << "updated " << reference << endl;
+        }
+        else if (!compare(output.c_str(), reference.c_str(), tolerance)
+                 || (serve && !compare(output2.c_str(), reference.c_str(), tolerance)))
+        {
+            cerr << "output differs from " << reference << " by more than " << tolerance << endl;
+            ok = false;
+        }
+    }
+    if (maxSeconds > 0 && seconds > maxSeconds)
+    {
+        cerr << "time regression: " << seconds << " s > " << maxSeconds << " s" << endl;
+        ok = false;
+    }
+    if (maxSlowdown > 0 && typical > 0 && seconds > maxSlowdown * typical)
+    {
+        cerr << setprecision(3) << "time regression: " << seconds << " s > " << maxSlowdown << " × " << typical
+             << " s, the median of the last runs" << endl;
+        ok = false;
+    }
+    if (maxRSS > 0 && rss > maxRSS)
+    {
+        cerr << "memory regression: " << rss << " MB > " << maxRSS << " MB" << endl;
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}